@@ -0,0 +1,36 @@
+// CycleCounter.c
+// Runs on TM4C123
+// Free-running CPU cycle count from the DWT, used to time the file
+// system calls and the flash operations under them.  The host build
+// counts the emulated flash busy time instead.
+
+#include <stdint.h>
+#include "CycleCounter.h"
+
+#ifdef FLASH_EMULATED
+#include "FlashEmulator.h"
+#else
+#define DWT_CTRL_R              (*((volatile uint32_t *)0xE0001000))
+#define DWT_CYCCNT_R            (*((volatile uint32_t *)0xE0001004))
+#define NVIC_DBG_INT_R          (*((volatile uint32_t *)0xE000EDFC))
+#define DWT_CTRL_CYCCNTENA      0x00000001  // enables DWT_CYCCNT_R
+#define NVIC_DBG_INT_TRCENA     0x01000000  // enables the DWT (DEMCR TRCENA)
+#endif
+
+//------------CycleCounter_Read------------
+// CPU cycles since the counter was first read; wraps at 2^32.
+// The first call starts the DWT cycle counter.
+// Input: none
+// Output: cycle count
+uint32_t CycleCounter_Read(void){
+#ifdef FLASH_EMULATED
+  return (uint32_t)(FlashEmulator_Time()*CYCLE_CLOCK_MHZ/1000);  // cycles of a CYCLE_CLOCK_MHZ core
+#else
+  if((DWT_CTRL_R&DWT_CTRL_CYCCNTENA) == 0){
+    NVIC_DBG_INT_R |= NVIC_DBG_INT_TRCENA;
+    DWT_CYCCNT_R = 0;
+    DWT_CTRL_R |= DWT_CTRL_CYCCNTENA;
+  }
+  return DWT_CYCCNT_R;
+#endif
+}
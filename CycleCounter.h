@@ -0,0 +1,24 @@
+// CycleCounter.h
+// Runs on TM4C123
+// Free-running CPU cycle count from the DWT, used to time the file
+// system calls and the flash operations under them.  The host build
+// counts the emulated flash busy time instead.
+
+#ifndef CYCLECOUNTER_H
+#define CYCLECOUNTER_H
+
+#include <stdint.h>
+
+// Core clock in MHz, for turning cycle counts into time
+#ifndef CYCLE_CLOCK_MHZ
+#define CYCLE_CLOCK_MHZ 16
+#endif
+
+//------------CycleCounter_Read------------
+// CPU cycles since the counter was first read; wraps at 2^32.
+// The first call starts the DWT cycle counter.
+// Input: none
+// Output: cycle count
+uint32_t CycleCounter_Read(void);
+
+#endif
@@ -0,0 +1,591 @@
+// Benchmark suite for the file system
+// Times each file system call under several workloads and reports
+// calls/s, bytes/s and p50/p99/max latency per call, and for the
+// commit policy workloads the most appends a power loss would lose.
+// On the TM4C123 time is read from the DWT cycle counter; on the host
+// build (make bench) it is the emulated flash busy time plus the host
+// CPU time of the call, so flash-bound results are comparable with the
+// target and CPU-bound ones are only indicative.
+// Results are kept in FS_Bench_Results and printed as CSV by
+// FS_Benchmark_Print.  On the board the suite runs from the main of
+// Test_File_System.c when FS_BENCHMARK is defined.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef FLASH_EMULATED
+#include <time.h>
+#endif
+#include "OS_File_System.h"
+#include "FlashProgram.h"
+#include "CycleCounter.h"
+#include "FS_Benchmark.h"
+
+#define Random_Reads 1000         // reads in the random_read workload
+#define Interleaved_Files 4       // files written round-robin
+#define Flush_Repeats 8           // flushes and mounts timed at each fill level
+#define Policy_Appends 256        // appends timed under each commit policy
+#define Policy_File 32            // sectors in each file of the commit policy workloads
+#define Policy_Files 32           // most files those workloads keep
+#define Hot_Percent 5             // share of the disk rewritten by the clean workloads
+
+// file system tables, from OS_File_System.c, for the baselines
+extern sector_t RAM_Directory[256], RAM_FAT[FS_MAX_SECTORS];
+extern uint32_t Disk_Start_Address;
+
+FS_Bench_Result FS_Bench_Results[FS_BENCH_MAX_RESULTS];
+uint8_t FS_Bench_Count;
+
+// Two measurements can be taken at once, e.g. OS_File_New and the
+// appends that have to follow it before the next file can be created
+static uint32_t Samples[2][FS_BENCH_SAMPLES];
+static FS_Bench_Result *Current[2];  // measurements being taken
+static uint32_t Seed = 1;         // random reads and sample replacement
+static uint8_t Log_Mode;
+static sector_t Capacity;         // sectors a formatted disk holds
+static uint8_t Data[FS_SECTOR_SIZE];
+
+#ifdef FLASH_EMULATED
+typedef uint64_t stamp_t;
+#else
+typedef uint32_t stamp_t;
+#endif
+
+// Helper function next_random returns the next value of a linear
+// congruential generator
+static uint32_t next_random(void) {
+	Seed = Seed * 1664525 + 1013904223;
+	return Seed >> 8;
+}
+
+// Helper function now returns a time stamp for elapsed
+static stamp_t now(void) {
+#ifdef FLASH_EMULATED
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec + FlashEmulator_Time();
+#else
+	return CycleCounter_Read();
+#endif
+}
+
+// Helper function elapsed returns the nanoseconds since a time stamp
+static uint32_t elapsed(stamp_t start) {
+	uint64_t ns;
+#ifdef FLASH_EMULATED
+	ns = now() - start;
+#else
+	ns = (uint64_t)(uint32_t)(now() - start) * 1000 / CYCLE_CLOCK_MHZ;
+#endif
+	return ns > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)ns;
+}
+
+// Helper function idle lets background work run between timed calls,
+// as the idle loop of an application would
+static void idle(void) {
+	OS_FS_Idle();
+#ifdef FLASH_EMULATED
+	while (FlashEmulator_Service()) {}
+#endif
+}
+
+// Helper function advance calls OS_FS_Tick once for every millisecond
+// that has passed; on the TM4C123 SysTick_Handler calls it instead
+static void advance(uint32_t ns) {
+#ifdef FLASH_EMULATED
+	static uint32_t pending;
+	pending += ns;
+	while (pending >= 1000000) {
+		pending -= 1000000;
+		OS_FS_Tick();
+	}
+#else
+	(void)ns;
+#endif
+}
+
+// Helper function begin starts measurement 'slot' of one call under
+// one workload; returns 0, or 255 if the results table is full
+static uint8_t begin(uint8_t slot, const char *workload, const char *op) {
+	FS_Bench_Result *r;
+	if (FS_Bench_Count >= FS_BENCH_MAX_RESULTS) {
+		Current[slot] = 0;
+		return 255;
+	}
+	r = &FS_Bench_Results[FS_Bench_Count++];
+	memset(r, 0, sizeof(*r));
+	r->workload = workload;
+	r->op = op;
+	r->log_mode = Log_Mode;
+	Current[slot] = r;
+	return 0;
+}
+
+// Helper function sample adds one timed call to measurement 'slot';
+// past FS_BENCH_SAMPLES calls a random sample of them is kept
+static void sample(uint8_t slot, uint32_t ns, uint32_t bytes, uint8_t failed) {
+	FS_Bench_Result *r = Current[slot];
+	uint32_t index;
+	if (r == 0) {
+		return;
+	}
+	if (r->count < FS_BENCH_SAMPLES) {
+		Samples[slot][r->count] = ns;
+	} else {
+		index = next_random() % (r->count + 1);
+		if (index < FS_BENCH_SAMPLES) {
+			Samples[slot][index] = ns;
+		}
+	}
+	r->count++;
+	r->errors += failed;
+	r->bytes += bytes;
+	r->total_ns += ns;
+	if (ns > r->max_ns) {
+		r->max_ns = ns;
+	}
+}
+
+// Helper function compare orders latencies for qsort
+static int compare(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Helper function end computes the percentiles of measurement 'slot'
+static void end(uint8_t slot) {
+	FS_Bench_Result *r = Current[slot];
+	uint32_t kept;
+	Current[slot] = 0;
+	if (r == 0 || r->count == 0) {
+		return;
+	}
+	kept = r->count < FS_BENCH_SAMPLES ? r->count : FS_BENCH_SAMPLES;
+	qsort(Samples[slot], kept, sizeof(Samples[slot][0]), compare);
+	r->p50_ns = Samples[slot][(kept - 1) / 2];
+	r->p99_ns = Samples[slot][(kept - 1) * 99 / 100];
+}
+
+// Helper function fill stamps a sector buffer with its file and
+// position, so reads can be checked
+static void fill(uint8_t num, sector_t location) {
+	memset(Data, num, sizeof(Data));
+	memcpy(Data + 1, &location, sizeof(location));
+}
+
+// Helper function matches checks a buffer stamped by fill
+static uint8_t matches(uint8_t num, sector_t location) {
+	return Data[0] == num && memcmp(Data + 1, &location, sizeof(location)) == 0 &&
+	       Data[FS_SECTOR_SIZE - 1] == num;
+}
+
+// Helper function walk_read reads sector 'location' of a file the way
+// OS_File_Read did before the skip index, hopping RAM_FAT from the
+// head; the baseline for the indexed reads
+static uint8_t walk_read(uint8_t num, sector_t location) {
+	sector_t n = RAM_Directory[num];
+	while (location > 0 && n != FS_NULL) {
+		n = RAM_FAT[n];
+		location--;
+	}
+	if (n == FS_NULL) {
+		return 255;
+	}
+	eDisk_ReadSector(Data, n);
+	return 0;
+}
+
+// Helper function timed_append appends one stamped sector, timed as
+// measurement 'slot'
+static uint8_t timed_append(uint8_t slot, uint8_t num, sector_t location) {
+	stamp_t start;
+	uint8_t status;
+	fill(num, location);
+	start = now();
+	status = OS_File_Append(num, Data);
+	sample(slot, elapsed(start), status ? 0 : FS_SECTOR_SIZE, status != 0);
+	idle();
+	return status;
+}
+
+// Helper function timed_flush flushes the metadata, timed
+static void timed_flush(void) {
+	stamp_t start = now();
+	uint8_t status = OS_File_Flush();
+	sample(0, elapsed(start), 0, status != 0);
+	idle();
+}
+
+// Helper function fresh_disk formats the disk for the next workload
+static void fresh_disk(void) {
+	OS_File_Format();
+	OS_FS_Log_Mode(Log_Mode);
+	idle();
+}
+
+// One file appended until the disk is full; measures the capacity
+// the other workloads are sized by
+static void huge_log(void) {
+	uint8_t num;
+	sector_t n = 0;
+	stamp_t start;
+	fresh_disk();
+	num = OS_File_New();
+	begin(0, "huge_log", "append");
+	while (n < FS_NULL) {
+		fill(num, n);
+		start = now();
+		if (OS_File_Append(num, Data) != 0) {
+			break;                                // disk full, not a failure
+		}
+		sample(0, elapsed(start), FS_SECTOR_SIZE, 0);
+		idle();
+		n++;
+	}
+	end(0);
+	Capacity = n;
+	begin(0, "huge_log", "flush");
+	timed_flush();
+	end(0);
+}
+
+// Many files of two sectors each; a new file has to be written
+// before OS_File_New hands out the next number
+static void small_files(void) {
+	uint16_t count = Capacity / 2, i;
+	stamp_t start;
+	uint8_t num;
+	if (count > 254) {
+		count = 254;
+	}
+	fresh_disk();
+	begin(0, "small_files", "new");
+	begin(1, "small_files", "append");
+	for (i = 0; i < count; i++) {
+		start = now();
+		num = OS_File_New();
+		sample(0, elapsed(start), 0, num == 255);
+		idle();
+		timed_append(1, num, 0);
+		timed_append(1, num, 1);
+	}
+	end(0);
+	end(1);
+	begin(0, "small_files", "flush");
+	timed_flush();
+	end(0);
+}
+
+// Several files appended round-robin to three quarters of the disk,
+// then read back at random and scanned
+static void interleaved(void) {
+	uint8_t files[Interleaved_Files], handle, i;
+	sector_t n, rounds = Capacity * 3 / 4 / Interleaved_Files, location;
+	uint32_t k;
+	stamp_t start;
+	uint8_t status;
+	fresh_disk();
+	for (i = 0; i < Interleaved_Files; i++) {
+		files[i] = OS_File_New();
+		fill(files[i], 0);
+		OS_File_Append(files[i], Data);         // claims the file number
+		idle();
+	}
+	begin(0, "interleaved", "append");
+	for (n = 1; n < rounds; n++) {
+		for (i = 0; i < Interleaved_Files; i++) {
+			timed_append(0, files[i], n);
+		}
+	}
+	end(0);
+	begin(0, "interleaved", "flush");
+	timed_flush();
+	end(0);
+
+	begin(0, "random_read", "read");
+	for (k = 0; k < Random_Reads; k++) {
+		i = next_random() % Interleaved_Files;
+		location = next_random() % rounds;
+		start = now();
+		status = OS_File_Read(files[i], location, Data);
+		sample(0, elapsed(start), status ? 0 : FS_SECTOR_SIZE, status != 0 || !matches(files[i], location));
+	}
+	end(0);
+
+	begin(0, "full_scan", "read_next");
+	for (i = 0; i < Interleaved_Files; i++) {
+		handle = OS_File_Open(files[i]);
+		for (n = 0; ; n++) {
+			start = now();
+			status = OS_File_ReadNext(handle, Data);
+			if (status != 0) {
+				break;                                // end of file
+			}
+			sample(0, elapsed(start), FS_SECTOR_SIZE, !matches(files[i], n));
+		}
+		OS_File_Close(handle);
+		if (n != rounds) {
+			sample(0, 0, 0, 1);                     // file came back short or long
+		}
+	}
+	end(0);
+
+	// every sector in order by position, through the skip index and
+	// by walking the chain from the head
+	begin(0, "full_scan", "read");
+	begin(1, "full_scan", "read_walk");
+	for (i = 0; i < Interleaved_Files; i++) {
+		for (n = 0; n < rounds; n++) {
+			start = now();
+			status = OS_File_Read(files[i], n, Data);
+			sample(0, elapsed(start), status ? 0 : FS_SECTOR_SIZE, status != 0 || !matches(files[i], n));
+			start = now();
+			status = walk_read(files[i], n);
+			sample(1, elapsed(start), status ? 0 : FS_SECTOR_SIZE, status != 0 || !matches(files[i], n));
+		}
+	}
+	end(0);
+	end(1);
+}
+
+// Sectors programmed into erased flash by eDisk_WriteSector, in
+// 128-byte bursts, and one word at a time with Flash_Write, as
+// eDisk_WriteSector did before the bursts; the baseline for them
+static void sector_writes(void) {
+	sector_t n, count = Capacity / 4;
+	uint32_t address, i, word;
+	stamp_t start;
+	uint8_t failed;
+	fresh_disk();
+	for (address = 0; address < 2 * (uint32_t)count * FS_SECTOR_SIZE; address += 1024) {
+		Flash_Erase(Disk_Start_Address + address);
+	}
+	begin(0, "sector_write", "write_bursts");
+	for (n = 0; n < count; n++) {
+		fill(1, n);
+		start = now();
+		failed = eDisk_WriteSector(Data, n) != 0;
+		sample(0, elapsed(start), failed ? 0 : FS_SECTOR_SIZE,
+		       failed || memcmp(FLASH_ADDR(Disk_Start_Address + (uint32_t)n * FS_SECTOR_SIZE), Data, FS_SECTOR_SIZE) != 0);
+	}
+	end(0);
+	begin(0, "sector_write", "write_words");
+	for (n = 0; n < count; n++) {
+		fill(1, n);
+		address = Disk_Start_Address + ((uint32_t)count + n) * FS_SECTOR_SIZE;
+		start = now();
+		failed = 0;
+		for (i = 0; i < FS_SECTOR_SIZE; i += 4) {
+			memcpy(&word, Data + i, 4);
+			failed |= Flash_Write(address + i, word) != NOERROR;
+		}
+		sample(0, elapsed(start), failed ? 0 : FS_SECTOR_SIZE,
+		       failed || memcmp(FLASH_ADDR(address), Data, FS_SECTOR_SIZE) != 0);
+	}
+	end(0);
+}
+
+// Files of Policy_File sectors filling three quarters of the disk,
+// the oldest deleted and a new one written in its place, under a
+// commit policy, see OS_FS_Commit_Policy; links into sectors freed by
+// a delete cannot be programmed in place and wait for a commit, so
+// the loss window is how many appends were not yet durable right
+// after one
+static void commit_policy(const char *workload, uint16_t appends, uint16_t ms) {
+	uint8_t files[Policy_Files], count, oldest = 0, i, status;
+	uint32_t n, ns, loss;
+	sector_t k;
+	stamp_t start;
+	count = Capacity * 3 / 4 / Policy_File;
+	if (count > Policy_Files) {
+		count = Policy_Files;
+	} else if (count == 0) {
+		count = 1;
+	}
+	fresh_disk();
+	for (i = 0; i < count; i++) {
+		files[i] = OS_File_New();
+		for (k = 0; k < Policy_File; k++) {
+			fill(files[i], k);
+			OS_File_Append(files[i], Data);
+			idle();
+		}
+	}
+	OS_File_Flush();
+	idle();
+	OS_FS_Commit_Policy(appends, ms);
+	begin(0, workload, "append");
+	for (n = 0; n < Policy_Appends; n++) {
+		k = n % Policy_File;
+		if (k == 0) {
+			OS_File_Delete(files[oldest]);
+			files[oldest] = OS_File_New();
+			idle();
+		}
+		fill(files[oldest], k);
+		start = now();
+		status = OS_File_Append(files[oldest], Data);
+		ns = elapsed(start);
+		sample(0, ns, status ? 0 : FS_SECTOR_SIZE, status != 0);
+		loss = OS_FS_Sequence() - OS_FS_Durable();
+		if (Current[0] != 0 && loss > Current[0]->loss_max) {
+			Current[0]->loss_max = loss;
+		}
+		idle();
+		advance(ns);                              // a commit that falls due runs in the next append
+		if (k == Policy_File - 1) {
+			oldest = (oldest + 1) % count;
+		}
+	}
+	end(0);
+	OS_FS_Commit_Policy(0, 0);
+}
+
+// Sustained appends in log mode with 'percent' of the disk live: a
+// cold file holds all but Hot_Percent of it and a hot file, limited by
+// OS_File_Limit, is rewritten twice over the capacity, so the cleaner
+// keeps copying cold sectors out of the segments it reclaims; each
+// append is timed with the background work after it
+static void clean_level(const char *workload, uint8_t percent) {
+	uint8_t cold, hot, status;
+	sector_t n, hot_sectors = (uint32_t)Capacity * Hot_Percent / 100;
+	sector_t cold_sectors = (uint32_t)Capacity * percent / 100;
+	uint32_t k;
+	stamp_t start;
+	if (hot_sectors == 0) {
+		hot_sectors = 1;
+	}
+	cold_sectors = cold_sectors > hot_sectors ? cold_sectors - hot_sectors : 0;
+	fresh_disk();
+	OS_FS_Log_Mode(1);
+	cold = OS_File_New();
+	for (n = 0; n < cold_sectors; n++) {
+		fill(cold, n);
+		OS_File_Append(cold, Data);
+		idle();
+	}
+	hot = OS_File_New();
+	OS_File_Limit(hot, hot_sectors);
+	begin(0, workload, "append");
+	for (k = 0; k < 2 * (uint32_t)Capacity; k++) {
+		fill(hot, k);
+		start = now();
+		status = OS_File_Append(hot, Data);
+		idle();
+		sample(0, elapsed(start), status ? 0 : FS_SECTOR_SIZE, status != 0);
+	}
+	end(0);
+	OS_FS_Log_Mode(Log_Mode);
+}
+
+// Flush and mount with the disk filled to 'percent' of its capacity
+static void fill_level(const char *workload, uint8_t percent) {
+	uint8_t num, r;
+	sector_t n, target = (uint32_t)Capacity * percent / 100;
+	stamp_t start;
+	uint8_t status;
+	fresh_disk();
+	num = OS_File_New();
+	for (n = 0; n < target; n++) {
+		fill(num, n);
+		OS_File_Append(num, Data);
+		idle();
+	}
+	begin(0, workload, "flush");
+	for (r = 0; r < Flush_Repeats; r++) {
+		fill(num, n);
+		if (n < Capacity && OS_File_Append(num, Data) == 0) {
+			n++;
+		}
+		idle();
+		timed_flush();
+	}
+	end(0);
+	begin(0, workload, "mount");
+	for (r = 0; r < Flush_Repeats; r++) {
+		start = now();
+		status = OS_FS_Mount();
+		sample(0, elapsed(start), 0, status != 0 || OS_File_Size(num) != n);
+		idle();
+	}
+	end(0);
+}
+
+//******** FS_Benchmark_Run*************
+// Run every workload on the mounted disk and record the results in
+// FS_Bench_Results; the disk is formatted, its files are lost
+// Inputs: log_mode, allocation mode to run in, see OS_FS_Log_Mode
+// Outputs: 0 if every call succeeded
+// Errors: 255 if any call failed, read back wrong data, or the
+//         results did not fit
+uint8_t FS_Benchmark_Run(uint8_t log_mode) {
+	uint8_t first = FS_Bench_Count, i, full = 0;
+	Log_Mode = log_mode;
+	huge_log();
+	small_files();
+	interleaved();
+	sector_writes();
+	commit_policy("commit1", 1, 0);
+	commit_policy("commit8", 8, 0);
+	commit_policy("commit32", 32, 0);
+	commit_policy("commit10ms", 0, 10);
+	fill_level("fill0", 0);
+	fill_level("fill25", 25);
+	fill_level("fill50", 50);
+	fill_level("fill75", 75);
+	fill_level("fill95", 95);
+	if (log_mode) {
+		clean_level("clean50", 50);
+		clean_level("clean80", 80);
+		clean_level("clean95", 95);
+	}
+	OS_File_Format();
+	OS_FS_Log_Mode(0);
+	if (FS_Bench_Count >= FS_BENCH_MAX_RESULTS) {
+		full = 1;
+	}
+	for (i = first; i < FS_Bench_Count; i++) {
+		if (FS_Bench_Results[i].errors != 0) {
+			return 255;
+		}
+	}
+	return full ? 255 : 0;
+}
+
+//******** FS_Benchmark_Print*************
+// Print the results as CSV, one line per workload and call, after a
+// header line; needs printf retargeted on the TM4C123
+// Inputs: none
+// Outputs: none
+void FS_Benchmark_Print(void) {
+	uint8_t i;
+	FS_Bench_Result *r;
+	double seconds;
+	printf("sector_size,sector_bits,log_mode,workload,op,count,errors,bytes,"
+	       "total_us,ops_per_s,bytes_per_s,p50_us,p99_us,max_us,loss_max\n");
+	for (i = 0; i < FS_Bench_Count; i++) {
+		r = &FS_Bench_Results[i];
+		seconds = r->total_ns / 1e9;
+		printf("%u,%u,%u,%s,%s,%lu,%lu,%lu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%lu\n",
+		       (unsigned)FS_SECTOR_SIZE, (unsigned)FS_SECTOR_BITS, (unsigned)r->log_mode,
+		       r->workload, r->op, (unsigned long)r->count, (unsigned long)r->errors,
+		       (unsigned long)r->bytes, r->total_ns / 1e3,
+		       seconds > 0 ? r->count / seconds : 0.0,
+		       seconds > 0 ? r->bytes / seconds : 0.0,
+		       r->p50_ns / 1e3, r->p99_ns / 1e3, r->max_ns / 1e3, (unsigned long)r->loss_max);
+	}
+}
+
+#ifdef FLASH_EMULATED
+// Host build: run the suite in both allocation modes and print CSV;
+// the exit status is nonzero if any call failed
+int main(void) {
+	uint8_t status;
+	OS_FS_Init();
+	status = FS_Benchmark_Run(0);
+	status |= FS_Benchmark_Run(1);
+	FS_Benchmark_Print();
+	return status != 0;
+}
+#endif
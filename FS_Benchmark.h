@@ -0,0 +1,36 @@
+#ifndef FS_BENCHMARK_H
+#define FS_BENCHMARK_H
+
+#include <stdint.h>
+
+// Latencies kept per measurement for the percentiles; a longer run is
+// sampled down to this many
+#ifndef FS_BENCH_SAMPLES
+#define FS_BENCH_SAMPLES 512
+#endif
+
+// Measurements one run of the suite can hold
+#define FS_BENCH_MAX_RESULTS 64
+
+// One file system call measured under one workload
+typedef struct {
+	const char *workload;     // e.g. "small_files", "fill50"
+	const char *op;           // call measured, e.g. "append"
+	uint8_t log_mode;         // allocation mode the suite ran in
+	uint32_t count;           // calls timed
+	uint32_t errors;          // calls that failed or read back wrong data
+	uint32_t bytes;           // bytes written or read by those calls
+	uint64_t total_ns;        // time spent in them
+	uint32_t p50_ns;          // median latency
+	uint32_t p99_ns;          // 99th percentile latency
+	uint32_t max_ns;          // worst latency
+	uint32_t loss_max;        // most appends that a power loss would have lost
+} FS_Bench_Result;
+
+extern FS_Bench_Result FS_Bench_Results[FS_BENCH_MAX_RESULTS];
+extern uint8_t FS_Bench_Count;
+
+uint8_t FS_Benchmark_Run(uint8_t);
+void FS_Benchmark_Print(void);
+
+#endif
@@ -0,0 +1,90 @@
+// Cycle-count histograms of file system and flash operations
+// Filled by the FS_INSTRUMENT_START/STOP pairs in OS_File_System.c
+// and FlashProgram.c when FS_INSTRUMENT is defined; read with
+// FS_Instrument_Snapshot, e.g. from a low-priority task or the
+// debugger.
+
+#include <stdint.h>
+#include <string.h>
+#include "FS_Instrument.h"
+
+long StartCritical (void);    // previous I bit, disable interrupts
+void EndCritical(long sr);    // restore I bit to previous value
+
+static FS_Instrument_Stats Stats;
+
+static const char *const Names[FS_OP_COUNT] = {
+	"new", "size", "append", "read", "read_ptr", "map", "open", "read_next",
+	"seek", "close", "flush", "format", "truncate", "delete", "limit",
+	"mount", "idle", "allocate", "checkpoint",
+	"flash_write", "flash_fastwrite", "flash_erase"
+};
+
+// Helper function bucket_of returns the histogram bucket for a
+// duration: the number of significant bits, capped at the last bucket
+static uint8_t bucket_of(uint32_t cycles) {
+	uint8_t bits = 0;
+
+	// binary search for the highest set bit, halving the window each step
+	if (cycles & 0xFFFF0000) { bits += 16; cycles >>= 16; }
+	if (cycles & 0x0000FF00) { bits += 8;  cycles >>= 8;  }
+	if (cycles & 0x000000F0) { bits += 4;  cycles >>= 4;  }
+	if (cycles & 0x0000000C) { bits += 2;  cycles >>= 2;  }
+	if (cycles & 0x00000002) { bits += 1;  cycles >>= 1;  }
+	bits += cycles;
+
+	return bits < FS_INSTRUMENT_BUCKETS ? bits : FS_INSTRUMENT_BUCKETS - 1;
+}
+
+//******** FS_Instrument_Record*************
+// Add one timed operation to its counters and histogram
+// Inputs: op, FS_OP_ number
+//         cycles, duration in CPU cycles
+// Outputs: none
+void FS_Instrument_Record(uint8_t op, uint32_t cycles) {
+	FS_Instrument_Op *entry;
+	long sr;
+	if (op >= FS_OP_COUNT) {
+		return;
+	}
+	entry = &Stats.op[op];
+	sr = StartCritical();
+	if (entry->count == 0 || cycles < entry->min_cycles) {
+		entry->min_cycles = cycles;
+	}
+	if (cycles > entry->max_cycles) {
+		entry->max_cycles = cycles;
+	}
+	entry->count++;
+	entry->total_cycles += cycles;
+	entry->histogram[bucket_of(cycles)]++;
+	EndCritical(sr);
+}
+
+//******** FS_Instrument_Snapshot*************
+// Copy every counter and histogram at one instant
+// Inputs: copy, where to put them
+// Outputs: none
+void FS_Instrument_Snapshot(FS_Instrument_Stats *copy) {
+	long sr = StartCritical();
+	memcpy(copy, &Stats, sizeof(Stats));
+	EndCritical(sr);
+}
+
+//******** FS_Instrument_Reset*************
+// Zero every counter and histogram
+// Inputs: none
+// Outputs: none
+void FS_Instrument_Reset(void) {
+	long sr = StartCritical();
+	memset(&Stats, 0, sizeof(Stats));
+	EndCritical(sr);
+}
+
+//******** FS_Instrument_Name*************
+// Short name of an operation, for reports
+// Inputs: op, FS_OP_ number
+// Outputs: name, or "unknown"
+const char *FS_Instrument_Name(uint8_t op) {
+	return op < FS_OP_COUNT ? Names[op] : "unknown";
+}
@@ -0,0 +1,77 @@
+#ifndef FS_INSTRUMENT_H
+#define FS_INSTRUMENT_H
+
+#include <stdint.h>
+#include "CycleCounter.h"
+
+// Timing of file system calls and flash operations with the DWT cycle
+// counter, compiled in only when FS_INSTRUMENT is defined
+// Each operation keeps a count, total, min, max and a log2 histogram
+// of its cycles; calls that make other timed calls include their time
+// (OS_File_Append includes FS_OP_ALLOCATE and the Flash_ operations)
+
+enum {
+	FS_OP_NEW,
+	FS_OP_SIZE,
+	FS_OP_APPEND,
+	FS_OP_READ,
+	FS_OP_READPTR,
+	FS_OP_MAP,
+	FS_OP_OPEN,
+	FS_OP_READNEXT,
+	FS_OP_SEEK,
+	FS_OP_CLOSE,
+	FS_OP_FLUSH,
+	FS_OP_FORMAT,
+	FS_OP_TRUNCATE,
+	FS_OP_DELETE,
+	FS_OP_LIMIT,
+	FS_OP_MOUNT,
+	FS_OP_IDLE,
+	FS_OP_ALLOCATE,           // choosing the sector for an append
+	FS_OP_CHECKPOINT,         // rewriting the directory and FAT
+	FS_OP_FLASH_WRITE,        // Flash_Write
+	FS_OP_FLASH_FASTWRITE,    // Flash_FastWrite
+	FS_OP_FLASH_ERASE,        // Flash_Erase
+	FS_OP_COUNT
+};
+
+// Bucket b of a histogram counts operations of 2^(b-1) to 2^b - 1
+// cycles, bucket 0 those of no cycles; the last bucket also takes
+// everything longer
+#define FS_INSTRUMENT_BUCKETS 24
+
+typedef struct {
+	uint32_t count;
+	uint32_t min_cycles;
+	uint32_t max_cycles;
+	uint64_t total_cycles;
+	uint32_t histogram[FS_INSTRUMENT_BUCKETS];
+} FS_Instrument_Op;
+
+typedef struct {
+	FS_Instrument_Op op[FS_OP_COUNT];
+} FS_Instrument_Stats;
+
+void FS_Instrument_Record(uint8_t, uint32_t);
+void FS_Instrument_Snapshot(FS_Instrument_Stats *);
+void FS_Instrument_Reset(void);
+const char *FS_Instrument_Name(uint8_t);
+
+// FS_INSTRUMENT_START(stamp) reads the cycle counter into a new local
+// 'stamp', also used by the flash events of FS_Trace.h;
+// FS_INSTRUMENT_STOP(op, stamp) records the cycles since
+#if defined(FS_INSTRUMENT) || defined(FS_TRACE)
+#define FS_INSTRUMENT_START(stamp)    uint32_t stamp = CycleCounter_Read()
+#else
+#define FS_INSTRUMENT_START(stamp)
+#endif
+#ifdef FS_INSTRUMENT
+#define FS_INSTRUMENT_STOP(op, stamp) FS_Instrument_Record((op), CycleCounter_Read() - (stamp))
+#elif defined(FS_TRACE)
+#define FS_INSTRUMENT_STOP(op, stamp) (void)(stamp)
+#else
+#define FS_INSTRUMENT_STOP(op, stamp)
+#endif
+
+#endif
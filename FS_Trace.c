@@ -0,0 +1,118 @@
+// Event trace of the file system and the flash
+// Filled by the FS_TRACE_ macros in OS_File_System.c, FlashProgram.c
+// and FlashAsync.c when FS_TRACE is defined.  The newest
+// FS_TRACE_EVENTS events are kept in RAM, where the debugger can read
+// them without stopping the target, and are forwarded to the Event
+// Recorder when that component is in the project.
+
+#include <stdint.h>
+#include <stdio.h>
+#include "FS_Instrument.h"
+#include "FS_Trace.h"
+#ifdef _RTE_
+#include "RTE_Components.h"
+#endif
+#ifdef RTE_Compiler_EventRecorder
+#include "EventRecorder.h"
+#endif
+
+long StartCritical (void);    // previous I bit, disable interrupts
+void EndCritical(long sr);    // restore I bit to previous value
+
+FS_Trace_Event FS_Trace_Buffer[FS_TRACE_EVENTS];
+uint32_t FS_Trace_Next;           // events recorded since the last clear
+
+static const char *const Flash_Names[] = {
+	"flash_write", "flash_fastwrite", "flash_erase", "async_program", "async_erase"
+};
+
+//******** FS_Trace_Record*************
+// Add an event to the ring buffer, overwriting the oldest when full;
+// may be called from interrupts
+// Inputs: id, component << 8 | message
+//         val1, val2, event data
+// Outputs: none
+void FS_Trace_Record(uint16_t id, uint32_t val1, uint32_t val2) {
+	FS_Trace_Event *event;
+	long sr = StartCritical();
+	event = &FS_Trace_Buffer[FS_Trace_Next & (FS_TRACE_EVENTS - 1)];
+	++FS_Trace_Next;
+	event->cycles = CycleCounter_Read();
+	event->id = id;
+	event->reserved = 0;
+	event->val1 = val1;
+	event->val2 = val2;
+	EndCritical(sr);
+#ifdef RTE_Compiler_EventRecorder
+	EventRecord2(EventID(EventLevelOp, id >> 8, id & 0xFF), val1, val2);
+#endif
+}
+
+//******** FS_Trace_Snapshot*************
+// Copy the newest events, oldest first
+// Inputs: copy, room for 'max' events
+//         max, most events wanted
+// Outputs: number of events copied
+uint16_t FS_Trace_Snapshot(FS_Trace_Event *copy, uint16_t max) {
+	uint32_t first, count, i;
+	long sr = StartCritical();
+	count = FS_Trace_Next < FS_TRACE_EVENTS ? FS_Trace_Next : FS_TRACE_EVENTS;
+	if (count > max) {
+		count = max;
+	}
+	first = FS_Trace_Next - count;
+	for (i = 0; i < count; ++i) {
+		copy[i] = FS_Trace_Buffer[(first + i) & (FS_TRACE_EVENTS - 1)];
+	}
+	EndCritical(sr);
+	return (uint16_t)count;
+}
+
+//******** FS_Trace_Clear*************
+// Empty the ring buffer
+// Inputs: none
+// Outputs: none
+void FS_Trace_Clear(void) {
+	long sr = StartCritical();
+	FS_Trace_Next = 0;
+	EndCritical(sr);
+}
+
+//******** FS_Trace_Print*************
+// Print the buffered events as CSV, oldest first, one event per line
+// with its name and decoded fields: the argument is the location,
+// sector or flash address, the duration is in cycles; needs printf
+// retargeted on the TM4C123
+// Inputs: none
+// Outputs: none
+void FS_Trace_Print(void) {
+	FS_Trace_Event event;
+	uint32_t i, count, first;
+	uint8_t component, message;
+	long sr;
+	count = FS_Trace_Next < FS_TRACE_EVENTS ? FS_Trace_Next : FS_TRACE_EVENTS;
+	first = FS_Trace_Next - count;
+	printf("cycles,event,file,status,argument,bytes,duration\n");
+	for (i = first; i < first + count; ++i) {
+		// one event at a time, so interrupts stay enabled while printing
+		sr = StartCritical();
+		event = FS_Trace_Buffer[i & (FS_TRACE_EVENTS - 1)];
+		EndCritical(sr);
+		component = event.id >> 8;
+		message = event.id & 0xFF;
+		if (component == FS_TRACE_FS && (message & 1) == 0) {
+			printf("%lu,%s_start,%lu,,%lu,,\n", (unsigned long)event.cycles,
+			       FS_Instrument_Name(message / 2), (unsigned long)event.val1,
+			       (unsigned long)event.val2);
+		} else if (component == FS_TRACE_FS) {
+			printf("%lu,%s_end,%lu,%lu,%lu,%lu,\n", (unsigned long)event.cycles,
+			       FS_Instrument_Name(message / 2), (unsigned long)(event.val1 & 0xFF),
+			       (unsigned long)(event.val1 >> 8), (unsigned long)(event.val2 & 0xFFFF),
+			       (unsigned long)(event.val2 >> 16));
+		} else if (component == FS_TRACE_FLASH && message <= FS_TRACE_ASYNC_ERASE) {
+			printf("%lu,%s,,,0x%05lX,,%lu\n", (unsigned long)event.cycles,
+			       Flash_Names[message], (unsigned long)event.val1,
+			       (unsigned long)event.val2);
+		}
+	}
+}
@@ -0,0 +1,68 @@
+#ifndef FS_TRACE_H
+#define FS_TRACE_H
+
+#include <stdint.h>
+#include "CycleCounter.h"
+
+// Trace of file system calls and flash operations in a RAM ring
+// buffer, compiled in only when FS_TRACE is defined
+// Events use the Event Recorder numbering, component << 8 | message,
+// and are described in EventRecorderStub.scvd; with the
+// Compiler:Event Recorder component selected they are also passed to
+// EventRecord2 so uVision decodes them live
+
+// Ring buffer size in events, a power of two
+#ifndef FS_TRACE_EVENTS
+#define FS_TRACE_EVENTS 128
+#endif
+#if (FS_TRACE_EVENTS & (FS_TRACE_EVENTS - 1)) != 0
+#error "FS_TRACE_EVENTS must be a power of two"
+#endif
+
+// Components
+#define FS_TRACE_FS     0x01      // messages 2*op (start), 2*op+1 (end), op an FS_OP_ number
+#define FS_TRACE_FLASH  0x02      // messages below
+
+// Flash messages: val1 is the address, val2 the duration in cycles
+#define FS_TRACE_FLASH_WRITE      0x00  // Flash_Write
+#define FS_TRACE_FLASH_FASTWRITE  0x01  // Flash_FastWrite
+#define FS_TRACE_FLASH_ERASE      0x02  // Flash_Erase
+#define FS_TRACE_ASYNC_PROGRAM    0x03  // one FlashAsync program operation, issue to interrupt
+#define FS_TRACE_ASYNC_ERASE      0x04  // one FlashAsync erase, issue to interrupt
+
+typedef struct {
+	uint32_t cycles;          // CycleCounter_Read when recorded
+	uint16_t id;              // component << 8 | message
+	uint16_t reserved;
+	uint32_t val1;
+	uint32_t val2;
+} FS_Trace_Event;
+
+void FS_Trace_Record(uint16_t, uint32_t, uint32_t);
+uint16_t FS_Trace_Snapshot(FS_Trace_Event *, uint16_t);
+void FS_Trace_Clear(void);
+void FS_Trace_Print(void);
+
+// FS_TRACE_START(op, file, argument) marks the start of a file system
+// call: val1 the file number (255 for none), val2 its location,
+// count or handle argument
+// FS_TRACE_END(op, file, status, sector, bytes) marks its end: val1
+// file | status << 8, val2 sector | bytes << 16
+// FS_TRACE_FLASH_OP(message, addr, stamp) marks a flash operation
+// that started at cycle count 'stamp' (see FS_INSTRUMENT_START)
+#ifdef FS_TRACE
+#define FS_TRACE_START(op, file, argument) \
+	FS_Trace_Record((FS_TRACE_FS << 8) | (2 * (op)), (file), (argument))
+#define FS_TRACE_END(op, file, status, sector, bytes) \
+	FS_Trace_Record((FS_TRACE_FS << 8) | (2 * (op) + 1), \
+	                (uint32_t)(file) | (uint32_t)(status) << 8, \
+	                (uint32_t)(sector) | (uint32_t)(bytes) << 16)
+#define FS_TRACE_FLASH_OP(message, addr, stamp) \
+	FS_Trace_Record((FS_TRACE_FLASH << 8) | (message), (addr), CycleCounter_Read() - (stamp))
+#else
+#define FS_TRACE_START(op, file, argument)
+#define FS_TRACE_END(op, file, status, sector, bytes)
+#define FS_TRACE_FLASH_OP(message, addr, stamp)
+#endif
+
+#endif
@@ -0,0 +1,286 @@
+// FlashAsync.c
+// Runs on TM4C123
+// Interrupt-driven flash program/erase engine.  Requests are queued
+// and started one after another from the flash controller's
+// completion interrupt, so the CPU keeps running while the flash
+// is busy instead of spinning with interrupts disabled.
+
+#include <stdint.h>
+#include "FlashProgram.h"
+#include "FlashAsync.h"
+#include "CycleCounter.h"
+#include "FS_Trace.h"
+
+#define FLASH_FMA_OFFSET_MAX    0x0003FFFF  // Address Offset max
+#define FLASH_FMC_WRKEY         0xA4420000  // FLASH write key (KEY bit of FLASH_BOOTCFG_R set)
+#define FLASH_FMC_WRKEY2        0x71D50000  // FLASH write key (KEY bit of FLASH_BOOTCFG_R cleared)
+#define FLASH_FMC_ERASE         0x00000002  // Erase a Page of Flash Memory
+#define FLASH_FMC_WRITE         0x00000001  // Write a Word into Flash Memory
+#define FLASH_FMC2_WRBUF        0x00000001  // Buffered Flash Memory Write
+#define FLASH_BOOTCFG_KEY       0x00000010  // KEY Select
+#define FLASH_FCIM_PMASK        0x00000002  // Programming Interrupt Mask
+#define FLASH_FCMISC_PMISC      0x00000002  // Programming Masked Interrupt Status and Clear
+#define FLASH_FCRIS_ERRORS      0x00002C01  // PROGRIS|ERRIS|INVDRIS|ARIS
+#define NVIC_EN0_R              (*((volatile uint32_t *)0xE000E100))
+#define NVIC_EN0_INT_FLASH      0x20000000  // interrupt 29 (vector 45)
+
+#define ERASED_WORD             0xFFFFFFFF  // value of a flash word after erase
+#define BURST_WORDS             32          // size of the FWBn write buffer
+
+long StartCritical (void);    // previous I bit, disable interrupts
+void EndCritical(long sr);    // restore I bit to previous value
+void WaitForInterrupt(void);  // low power mode
+
+enum { OP_PROGRAM, OP_ERASE };
+
+typedef struct {
+  uint8_t op;                     // OP_PROGRAM or OP_ERASE
+  uint32_t addr;                  // next address to program, or block to erase
+  const uint8_t *source;          // next bytes to program
+  uint16_t count;                 // words still to program
+  FlashAsync_Callback callback;
+  void *context;
+} FlashAsync_Request;
+
+static FlashAsync_Request Queue[FLASH_ASYNC_QUEUE_SIZE];
+static volatile uint8_t Head;     // request at the front of the queue
+static volatile uint8_t Count;    // requests queued, including the front one
+static volatile uint8_t Busy;     // set while an operation is being started or is in progress
+static uint8_t Issued;            // set while the hardware is working on the front request
+static uint16_t InFlight;         // words covered by the program operation in progress
+#ifdef FS_TRACE
+static uint32_t IssueTime;        // CycleCounter_Read when the operation in progress started
+#endif
+
+// Write key expected by FMC and FMC2
+static uint32_t Key(void){
+  if(FLASH_CTL_BOOTCFG&FLASH_BOOTCFG_KEY){        // by default, the key is 0xA442
+    return FLASH_FMC_WRKEY;
+  }
+  return FLASH_FMC_WRKEY2;                         // otherwise, the key is 0x71D5
+}
+
+// Little-endian word from four bytes of the caller's buffer
+static uint32_t ReadWord(const uint8_t *p){
+  return ((uint32_t)p[0]) | ((uint32_t)p[1] << 8) |
+         ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Retire the front request and run its callback
+static void Complete(int status){
+  FlashAsync_Request *req = &Queue[Head];
+  FlashAsync_Callback callback = req->callback;
+  void *context = req->context;
+  Head = (Head + 1) % FLASH_ASYNC_QUEUE_SIZE;
+  Count = Count - 1;
+  if(callback){
+    callback(context, status);
+  }
+}
+
+// Start the hardware on the front request, retiring requests (or
+// parts of them) that consist only of erased words along the way.
+// Called with interrupts disabled.
+static void Start(void){
+  FlashAsync_Request *req;
+  uint16_t n, i;
+  Busy = 1;
+  // a completion left pending by a blocking FlashProgram.c call while
+  // interrupts were off would otherwise end this operation at once
+  FLASH_CTL_CLEAR(FLASH_FCMISC_PMISC|FLASH_FCRIS_ERRORS);
+  while(Count > 0){
+    req = &Queue[Head];
+    if(req->op == OP_ERASE){
+      FLASH_CTL->FMA = req->addr;
+      FLASH_CTL->FMC = Key()|FLASH_FMC_ERASE;     // start erasing 1 KB block
+      Issued = 1;
+#ifdef FS_TRACE
+      IssueTime = CycleCounter_Read();
+#endif
+      return;
+    }
+    if(req->count == 0){
+      Complete(NOERROR);
+      continue;
+    }
+    if((req->addr % (4*BURST_WORDS)) == 0){
+      // buffered write of up to 32 words, trailing erased words trimmed
+      n = (req->count < BURST_WORDS) ? req->count : BURST_WORDS;
+      InFlight = n;
+      while((n > 0) && (ReadWord(&req->source[4*(n - 1)]) == ERASED_WORD)){
+        n = n - 1;
+      }
+      if(n == 0){
+        req->addr += 4*InFlight;                  // whole burst already erased
+        req->source += 4*InFlight;
+        req->count -= InFlight;
+        continue;
+      }
+      for(i = 0; i < n; i = i + 1){
+        FLASH_CTL->FWBN[i] = ReadWord(&req->source[4*i]);
+      }
+      FLASH_CTL->FMA = req->addr;
+      FLASH_CTL->FMC2 = Key()|FLASH_FMC2_WRBUF;   // start writing
+    } else{
+      // single word up to the next 128-byte boundary
+      InFlight = 1;
+      if(ReadWord(req->source) == ERASED_WORD){
+        req->addr += 4;
+        req->source += 4;
+        req->count -= 1;
+        continue;
+      }
+      FLASH_CTL->FMD = ReadWord(req->source);
+      FLASH_CTL->FMA = req->addr;
+      FLASH_CTL->FMC = Key()|FLASH_FMC_WRITE;     // start writing
+    }
+    Issued = 1;
+#ifdef FS_TRACE
+    IssueTime = CycleCounter_Read();
+#endif
+    return;
+  }
+  Busy = 0;
+}
+
+// Add a request to the back of the queue and start it if the
+// engine is idle
+static int Enqueue(FlashAsync_Request *req){
+  long sr = StartCritical();
+  if(Count >= FLASH_ASYNC_QUEUE_SIZE){
+    EndCritical(sr);
+    return ERROR;
+  }
+  Queue[(Head + Count) % FLASH_ASYNC_QUEUE_SIZE] = *req;
+  Count = Count + 1;
+  if(!Busy){
+    Start();
+  }
+  EndCritical(sr);
+  return NOERROR;
+}
+
+//------------FlashAsync_Init------------
+// Empty the request queue and enable the flash controller's
+// programming-complete interrupt.
+// Input: none
+// Output: none
+void FlashAsync_Init(void){
+  long sr = StartCritical();
+  Head = 0;
+  Count = 0;
+  Busy = 0;
+  Issued = 0;
+  FLASH_CTL_CLEAR(FLASH_FCMISC_PMISC|FLASH_FCRIS_ERRORS);  // clear stale flags
+  FLASH_CTL->FCIM |= FLASH_FCIM_PMASK;           // arm programming-complete interrupt
+#ifndef FLASH_EMULATED
+  NVIC_EN0_R = NVIC_EN0_INT_FLASH;               // enable interrupt 29 in NVIC
+#endif
+  EndCritical(sr);
+}
+
+//------------FlashAsync_Program------------
+// Queue programming of 'count' words taken from a byte buffer.
+// 128-byte aligned runs go through the 32-word write buffer, other
+// words are programmed one at a time; words equal to 0xFFFFFFFF are
+// skipped.  The buffer must stay unchanged until the callback runs.
+// Input: addr     4-byte aligned flash memory address to start writing
+//        source   pointer to 4*count bytes, little-endian words
+//        count    number of 32-bit words
+//        callback function called on completion, may be 0
+//        context  passed to callback
+// Output: 'NOERROR' if queued, 'ERROR' if the queue is full or the
+//         address is invalid
+int FlashAsync_Program(uint32_t addr, const uint8_t *source, uint16_t count,
+                       FlashAsync_Callback callback, void *context){
+  FlashAsync_Request req;
+  if(((addr % 4) != 0) || ((addr + 4*(uint32_t)count) > (FLASH_FMA_OFFSET_MAX + 1))){
+    return ERROR;
+  }
+  req.op = OP_PROGRAM;
+  req.addr = addr;
+  req.source = source;
+  req.count = count;
+  req.callback = callback;
+  req.context = context;
+  return Enqueue(&req);
+}
+
+//------------FlashAsync_Erase------------
+// Queue an erase of a 1 KB block of flash.
+// Input: addr     1-KB aligned flash memory address to erase
+//        callback function called on completion, may be 0
+//        context  passed to callback
+// Output: 'NOERROR' if queued, 'ERROR' if the queue is full or the
+//         address is invalid
+int FlashAsync_Erase(uint32_t addr, FlashAsync_Callback callback, void *context){
+  FlashAsync_Request req;
+  if(((addr % 1024) != 0) || (addr > FLASH_FMA_OFFSET_MAX)){
+    return ERROR;
+  }
+  req.op = OP_ERASE;
+  req.addr = addr;
+  req.source = 0;
+  req.count = 0;
+  req.callback = callback;
+  req.context = context;
+  return Enqueue(&req);
+}
+
+//------------FlashAsync_Pending------------
+// Number of requests queued or in progress.
+// Input: none
+// Output: 0 when the engine is idle
+int FlashAsync_Pending(void){
+  return Count;
+}
+
+//------------FlashAsync_Wait------------
+// Sleep until every queued request has completed.  If the caller
+// already has interrupts disabled FlashCtl_Handler cannot run, so
+// it is called here instead each time the CPU wakes.
+// Input: none
+// Output: none
+void FlashAsync_Wait(void){
+  long sr = StartCritical();
+  while(Count > 0){
+    WaitForInterrupt();                            // wakes on the pending flash interrupt
+    if(sr){
+      FlashCtl_Handler();                          // masked by the caller: poll it
+    } else{
+      EndCritical(sr);                             // let FlashCtl_Handler run
+      sr = StartCritical();
+    }
+  }
+  EndCritical(sr);
+}
+
+//------------FlashCtl_Handler------------
+// Flash controller interrupt; completes the operation in progress
+// and starts the next one.  Do not call the blocking FlashProgram.c
+// functions while FlashAsync_Pending() is nonzero.
+void FlashCtl_Handler(void){
+  FlashAsync_Request *req;
+  uint32_t errors = FLASH_CTL->FCRIS&FLASH_FCRIS_ERRORS;
+  if((FLASH_CTL->FCMISC&FLASH_FCMISC_PMISC) == 0){
+    return;
+  }
+  FLASH_CTL_CLEAR(FLASH_FCMISC_PMISC|errors);      // acknowledge
+  if(!Issued){
+    return;                                        // not one of ours
+  }
+  Issued = 0;
+  req = &Queue[Head];
+  FS_TRACE_FLASH_OP((req->op == OP_ERASE) ? FS_TRACE_ASYNC_ERASE : FS_TRACE_ASYNC_PROGRAM,
+                    req->addr, IssueTime);
+  if(errors){
+    Complete(ERROR);
+  } else if(req->op == OP_ERASE){
+    Complete(NOERROR);
+  } else{
+    req->addr += 4*InFlight;
+    req->source += 4*InFlight;
+    req->count -= InFlight;
+  }
+  Start();
+}
@@ -0,0 +1,103 @@
+// FlashAsync.h
+// Runs on TM4C123
+// Interrupt-driven flash program/erase engine.  Requests are queued
+// and started one after another from the flash controller's
+// completion interrupt, so the CPU keeps running while the flash
+// is busy instead of spinning with interrupts disabled.
+
+#ifndef FLASHASYNC_H
+#define FLASHASYNC_H
+
+#include <stdint.h>
+
+// Flash memory controller register block at 0x400FD000
+typedef struct {
+  volatile uint32_t FMA;          // 0x000 address
+  volatile uint32_t FMD;          // 0x004 data
+  volatile uint32_t FMC;          // 0x008 control
+  volatile uint32_t FCRIS;        // 0x00C raw interrupt status
+  volatile uint32_t FCIM;         // 0x010 interrupt mask
+  volatile uint32_t FCMISC;       // 0x014 masked interrupt status and clear
+  uint32_t reserved0[2];          // 0x018-0x01C
+  volatile uint32_t FMC2;         // 0x020 control 2 (buffered write)
+  uint32_t reserved1[3];          // 0x024-0x02C
+  volatile uint32_t FWBVAL;       // 0x030 write buffer valid
+  uint32_t reserved2[51];         // 0x034-0x0FC
+  volatile uint32_t FWBN[32];     // 0x100-0x17C write buffer
+} FlashCtl_Regs;
+
+// A host build points these at an emulated register block, and
+// FLASH_ADDR at the emulated memory behind a flash address
+#ifdef FLASH_EMULATED
+#include "FlashEmulator.h"
+#endif
+#ifndef FLASH_CTL
+#define FLASH_CTL               ((FlashCtl_Regs *)0x400FD000)
+#define FLASH_CTL_BOOTCFG       (*((volatile uint32_t *)0x400FE1D0))
+#endif
+#ifndef FLASH_ADDR
+#define FLASH_ADDR(addr)        ((const uint8_t *)(addr))
+#endif
+// FCMISC is write-1-to-clear, which a host build emulates
+#ifndef FLASH_CTL_CLEAR
+#define FLASH_CTL_CLEAR(bits)   (FLASH_CTL->FCMISC = (bits))
+#endif
+
+#define FLASH_ASYNC_QUEUE_SIZE  8   // requests that can be outstanding
+
+// Called from FlashCtl_Handler when a request finishes
+// context is the pointer given with the request
+// status is NOERROR or ERROR (defined in FlashProgram.h)
+typedef void (*FlashAsync_Callback)(void *context, int status);
+
+//------------FlashAsync_Init------------
+// Empty the request queue and enable the flash controller's
+// programming-complete interrupt.
+// Input: none
+// Output: none
+void FlashAsync_Init(void);
+
+//------------FlashAsync_Program------------
+// Queue programming of 'count' words taken from a byte buffer.
+// 128-byte aligned runs go through the 32-word write buffer, other
+// words are programmed one at a time; words equal to 0xFFFFFFFF are
+// skipped.  The buffer must stay unchanged until the callback runs.
+// Input: addr     4-byte aligned flash memory address to start writing
+//        source   pointer to 4*count bytes, little-endian words
+//        count    number of 32-bit words
+//        callback function called on completion, may be 0
+//        context  passed to callback
+// Output: 'NOERROR' if queued, 'ERROR' if the queue is full or the
+//         address is invalid
+int FlashAsync_Program(uint32_t addr, const uint8_t *source, uint16_t count,
+                       FlashAsync_Callback callback, void *context);
+
+//------------FlashAsync_Erase------------
+// Queue an erase of a 1 KB block of flash.
+// Input: addr     1-KB aligned flash memory address to erase
+//        callback function called on completion, may be 0
+//        context  passed to callback
+// Output: 'NOERROR' if queued, 'ERROR' if the queue is full or the
+//         address is invalid
+int FlashAsync_Erase(uint32_t addr, FlashAsync_Callback callback, void *context);
+
+//------------FlashAsync_Pending------------
+// Number of requests queued or in progress.
+// Input: none
+// Output: 0 when the engine is idle
+int FlashAsync_Pending(void);
+
+//------------FlashAsync_Wait------------
+// Sleep until every queued request has completed.  Safe to call
+// with interrupts disabled; the handler is then polled instead.
+// Input: none
+// Output: none
+void FlashAsync_Wait(void);
+
+//------------FlashCtl_Handler------------
+// Flash controller interrupt; completes the operation in progress
+// and starts the next one.  Do not call the blocking FlashProgram.c
+// functions while FlashAsync_Pending() is nonzero.
+void FlashCtl_Handler(void);
+
+#endif
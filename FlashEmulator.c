@@ -0,0 +1,278 @@
+// FlashEmulator.c
+// Runs on Linux and other hosts
+// RAM-backed model of the TM4C123 flash memory and its controller,
+// so the file system builds and runs off-target (make, FLASH_EMULATED).
+// The emulated flash keeps NOR semantics: programming only clears
+// bits, erasing works on 1 KB blocks, and buffered writes go through
+// a 32-word (128-byte) FWBn buffer.  Every operation is charged to an
+// emulated clock by a replaceable timing model.
+// Also provides the interrupt primitives that startup.s provides on
+// the target.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "FlashAsync.h"
+#include "FlashEmulator.h"
+
+#define FLASH_FMC_WRKEY         0xA4420000  // FLASH write key (KEY bit of FLASH_BOOTCFG_R set)
+#define FLASH_FMC_WRKEY2        0x71D50000  // FLASH write key (KEY bit of FLASH_BOOTCFG_R cleared)
+#define FLASH_FMC_KEY_MASK      0xFFFF0000
+#define FLASH_FMC_MERASE        0x00000004  // Mass Erase Flash Memory
+#define FLASH_FMC_ERASE         0x00000002  // Erase a Page of Flash Memory
+#define FLASH_FMC_WRITE         0x00000001  // Write a Word into Flash Memory
+#define FLASH_FMC2_WRBUF        0x00000001  // Buffered Flash Memory Write
+#define FLASH_BOOTCFG_KEY       0x00000010  // KEY Select
+#define FLASH_FCRIS_ARIS        0x00000001  // Access Raw Interrupt Status
+#define FLASH_FCRIS_PRIS        0x00000002  // Programming Raw Interrupt Status
+#define FLASH_FCRIS_INVDRIS     0x00000400  // Invalid Data Raw Interrupt Status
+#define FLASH_FCIM_PMASK        0x00000002  // Programming Interrupt Mask
+#define FLASH_FCMISC_PMISC      0x00000002  // Programming Masked Interrupt Status and Clear
+
+#define ERASED_WORD             0xFFFFFFFF  // value of a flash word after erase
+#define BURST_WORDS             32          // size of the FWBn write buffer
+#define BLOCK_SIZE              1024        // bytes per erase block
+
+void FlashCtl_Handler(void);
+
+volatile uint32_t FlashEmulator_Regs[0x180/4];
+volatile uint32_t FlashEmulator_BootCfg = 0xFFFFFFFE;   // reset value, KEY bit set
+FlashEmulator_Counters FlashEmulator_Stats;
+
+static uint32_t Memory[FLASH_EMULATOR_SIZE/4];  // the emulated flash
+static uint8_t Ready;             // set once Memory has been erased
+static FlashEmulator_Timing Model;
+static uint8_t Masked;            // I bit of PRIMASK
+static uint8_t InHandler;         // set while FlashCtl_Handler runs
+
+// Default timing model, from the notes in FlashProgram.c (80 MHz):
+// 10 words take 678 us one at a time and 335 us through the buffer
+static uint32_t DefaultTiming(FlashEmulator_Op op, uint32_t words){
+  if(op == FLASH_EMULATOR_WORD){
+    return 67800;
+  }
+  if(op == FLASH_EMULATOR_BUFFER){
+    return 33500*words;
+  }
+  return 15000000;
+}
+
+// Erase the whole emulated flash the first time it is used
+static void Prepare(void){
+  if(!Ready){
+    memset(Memory, 0xFF, sizeof(Memory));
+    Ready = 1;
+  }
+}
+
+// Index of the word at flash address addr, or -1 outside the region
+static long WordIndex(uint32_t addr){
+  if((addr < FLASH_EMULATOR_BASE) || (addr - FLASH_EMULATOR_BASE >= FLASH_EMULATOR_SIZE)){
+    return -1;
+  }
+  return (addr - FLASH_EMULATOR_BASE)/4;
+}
+
+// Program one word with NOR semantics; returns the FCRIS error bits
+static uint32_t ProgramWord(uint32_t addr, uint32_t data){
+  long i = WordIndex(addr);
+  if(i < 0){
+    FlashEmulator_Stats.access_errors++;
+    return FLASH_FCRIS_ARIS;
+  }
+  if(data == ERASED_WORD){
+    return 0;                                       // nothing to clear
+  }
+  FlashEmulator_Stats.words_programmed++;
+  if((Memory[i]&data) != data){
+    Memory[i] &= data;                              // bits only go from 1 to 0
+    FlashEmulator_Stats.violations++;
+    return FLASH_FCRIS_INVDRIS;
+  }
+  Memory[i] = data;
+  return 0;
+}
+
+// Key the controller expects in FMC and FMC2
+static uint32_t Key(void){
+  if(FlashEmulator_BootCfg&FLASH_BOOTCFG_KEY){
+    return FLASH_FMC_WRKEY;
+  }
+  return FLASH_FMC_WRKEY2;
+}
+
+// Carry out the command written to FMC or FMC2, if any, and raise
+// the programming-complete flags; returns 1 if a command ran
+static int Run(void){
+  uint32_t errors = 0, addr = FLASH_CTL->FMA;
+  uint32_t fmc = FLASH_CTL->FMC, fmc2 = FLASH_CTL->FMC2;
+  uint32_t ns = 0, i, words = 0;
+  long first;
+  Prepare();
+  if(fmc&(FLASH_FMC_WRITE|FLASH_FMC_ERASE|FLASH_FMC_MERASE)){
+    FLASH_CTL->FMC = 0;
+    if((fmc&FLASH_FMC_KEY_MASK) != Key()){
+      return 0;                                     // wrong key, ignored
+    }
+    if(fmc&FLASH_FMC_WRITE){
+      errors = ProgramWord(addr, FLASH_CTL->FMD);
+      FlashEmulator_Stats.word_programs++;
+      ns = Model(FLASH_EMULATOR_WORD, 1);
+    } else if(fmc&FLASH_FMC_ERASE){
+      first = WordIndex(addr&~(BLOCK_SIZE - 1));
+      if(first < 0){
+        FlashEmulator_Stats.access_errors++;
+        errors = FLASH_FCRIS_ARIS;
+      } else{
+        memset(&Memory[first], 0xFF, BLOCK_SIZE);
+        FlashEmulator_Stats.erases++;
+      }
+      ns = Model(FLASH_EMULATOR_ERASE, 0);
+    } else{
+      memset(Memory, 0xFF, sizeof(Memory));
+      FlashEmulator_Stats.erases += FLASH_EMULATOR_SIZE/BLOCK_SIZE;
+      ns = Model(FLASH_EMULATOR_ERASE, 0)*(FLASH_EMULATOR_SIZE/BLOCK_SIZE);
+    }
+  } else if(fmc2&FLASH_FMC2_WRBUF){
+    FLASH_CTL->FMC2 = 0;
+    if((fmc2&FLASH_FMC_KEY_MASK) != Key()){
+      return 0;
+    }
+    // the buffer is programmed at the 128-byte aligned row holding FMA;
+    // words left at 0xFFFFFFFF stand for FWBVAL bits that are clear
+    addr &= ~(4*BURST_WORDS - 1);
+    for(i = 0; i < BURST_WORDS; i = i + 1){
+      if(FLASH_CTL->FWBN[i] != ERASED_WORD){
+        errors |= ProgramWord(addr + 4*i, FLASH_CTL->FWBN[i]);
+        words = i + 1;
+      }
+      FLASH_CTL->FWBN[i] = ERASED_WORD;
+    }
+    FlashEmulator_Stats.buffer_programs++;
+    ns = Model(FLASH_EMULATOR_BUFFER, words);
+  } else{
+    return 0;
+  }
+  FlashEmulator_Stats.busy_ns += ns;
+  FLASH_CTL->FCRIS |= FLASH_FCRIS_PRIS|errors;
+  if(FLASH_CTL->FCIM&FLASH_FCIM_PMASK){
+    FLASH_CTL->FCMISC |= FLASH_FCMISC_PMISC;
+  }
+  return 1;
+}
+
+// Take the flash interrupt while it is pending and not masked; the
+// handler acknowledges it through FlashEmulator_Clear
+static void Deliver(void){
+  while(!Masked && !InHandler && (FLASH_CTL->FCMISC&FLASH_FCMISC_PMISC)){
+    InHandler = 1;
+    FlashCtl_Handler();
+    InHandler = 0;
+    Run();                                          // the next request it started
+  }
+}
+
+//------------FlashEmulator_Pointer------------
+// Where the CPU reads flash address 'addr' on the host.
+// Input: addr  flash memory address inside the emulated region
+// Output: pointer into the emulated flash; aborts outside the region
+const uint8_t *FlashEmulator_Pointer(uint32_t addr){
+  Prepare();
+  if((addr < FLASH_EMULATOR_BASE) || (addr - FLASH_EMULATOR_BASE > FLASH_EMULATOR_SIZE)){
+    fprintf(stderr, "FlashEmulator: read of 0x%08lX outside 0x%08lX-0x%08lX\n",
+            (unsigned long)addr, (unsigned long)FLASH_EMULATOR_BASE,
+            (unsigned long)(FLASH_EMULATOR_BASE + FLASH_EMULATOR_SIZE - 1));
+    abort();
+  }
+  return (const uint8_t *)Memory + (addr - FLASH_EMULATOR_BASE);
+}
+
+//------------FlashEmulator_Reset------------
+// Return the emulated flash to a blank chip: every byte 0xFF, the
+// controller idle, the clock and the counters at zero.
+// Input: none
+// Output: none
+void FlashEmulator_Reset(void){
+  memset(Memory, 0xFF, sizeof(Memory));
+  Ready = 1;
+  memset((void *)FlashEmulator_Regs, 0, sizeof(FlashEmulator_Regs));
+  memset((void *)FLASH_CTL->FWBN, 0xFF, sizeof(FLASH_CTL->FWBN));
+  memset(&FlashEmulator_Stats, 0, sizeof(FlashEmulator_Stats));
+}
+
+//------------FlashEmulator_SetTiming------------
+// Replace the timing model.
+// Input: model  function pricing each operation, 0 for the default
+// Output: none
+void FlashEmulator_SetTiming(FlashEmulator_Timing model){
+  Model = model ? model : DefaultTiming;
+}
+
+//------------FlashEmulator_Time------------
+// Emulated time the flash has been busy since the last reset.
+// Input: none
+// Output: nanoseconds
+uint64_t FlashEmulator_Time(void){
+  return FlashEmulator_Stats.busy_ns;
+}
+
+//------------FlashEmulator_Register------------
+// Finish the operation in progress, then return a register of the
+// block.
+// Input: offset  byte offset of the register, as in FlashCtl_Regs
+// Output: pointer to the emulated register
+volatile uint32_t *FlashEmulator_Register(uint32_t offset){
+  if(!Model){
+    FlashEmulator_SetTiming(0);
+  }
+  Run();
+  return &FlashEmulator_Regs[offset/4];
+}
+
+//------------FlashEmulator_Clear------------
+// Write 'bits' to FCMISC, which clears them in FCMISC and FCRIS as
+// the write-1-to-clear register of the target does.
+// Input: bits  FCMISC bits to clear
+// Output: none
+void FlashEmulator_Clear(uint32_t bits){
+  FLASH_CTL->FCMISC &= ~bits;
+  FLASH_CTL->FCRIS &= ~bits;
+}
+
+//------------FlashEmulator_Service------------
+// Finish the operation in progress and, if interrupts are enabled,
+// run FlashCtl_Handler for it.
+// Input: none
+// Output: 1 if an operation finished, 0 if the flash was idle
+int FlashEmulator_Service(void){
+  int done;
+  if(!Model){
+    FlashEmulator_SetTiming(0);
+  }
+  done = Run();
+  Deliver();
+  return done;
+}
+
+// Interrupt primitives of startup.s; the flash interrupt is taken
+// when interrupts are enabled again, as on the target
+void DisableInterrupts(void){
+  Masked = 1;
+}
+void EnableInterrupts(void){
+  Masked = 0;
+  Deliver();
+}
+long StartCritical(void){
+  long sr = Masked;
+  Masked = 1;
+  return sr;
+}
+void EndCritical(long sr){
+  Masked = (uint8_t)sr;
+  Deliver();
+}
+void WaitForInterrupt(void){
+  FlashEmulator_Service();                         // the flash finishes while the CPU sleeps
+}
@@ -0,0 +1,110 @@
+// FlashEmulator.h
+// Runs on Linux and other hosts
+// RAM-backed model of the TM4C123 flash memory and its controller,
+// so the file system builds and runs off-target (make, FLASH_EMULATED).
+// The emulated flash keeps NOR semantics: programming only clears
+// bits, erasing works on 1 KB blocks, and buffered writes go through
+// a 32-word (128-byte) FWBn buffer.  Every operation is charged to an
+// emulated clock by a replaceable timing model.
+
+#ifndef FLASHEMULATOR_H
+#define FLASHEMULATOR_H
+
+#include <stdint.h>
+
+// Flash addresses backed by the emulator: the disk region of the
+// TM4C123 by default
+#ifndef FLASH_EMULATOR_BASE
+#define FLASH_EMULATOR_BASE     0x20000
+#endif
+#ifndef FLASH_EMULATOR_SIZE
+#define FLASH_EMULATOR_SIZE     0x20000
+#endif
+
+// Emulated register block, laid out as FlashCtl_Regs, and BOOTCFG
+extern volatile uint32_t FlashEmulator_Regs[0x180/4];
+extern volatile uint32_t FlashEmulator_BootCfg;
+
+// Redirect the register and memory accesses of FlashAsync.c and
+// OS_File_System.c (see FlashAsync.h)
+#define FLASH_CTL               ((FlashCtl_Regs *)FlashEmulator_Regs)
+#define FLASH_CTL_BOOTCFG       FlashEmulator_BootCfg
+#define FLASH_ADDR(addr)        FlashEmulator_Pointer(addr)
+#define FLASH_CTL_CLEAR(bits)   FlashEmulator_Clear(bits)
+
+// Operations the timing model prices
+typedef enum {
+  FLASH_EMULATOR_WORD,          // one word through FMD/FMC
+  FLASH_EMULATOR_BUFFER,        // one FWBn buffer through FMC2
+  FLASH_EMULATOR_ERASE          // one 1 KB block
+} FlashEmulator_Op;
+
+// Timing model: nanoseconds the flash is busy for an operation that
+// programs 'words' words (0 for an erase)
+typedef uint32_t (*FlashEmulator_Timing)(FlashEmulator_Op op, uint32_t words);
+
+// Counters kept by the emulator
+typedef struct {
+  uint32_t word_programs;       // FMC word program operations
+  uint32_t buffer_programs;     // FMC2 buffered program operations
+  uint32_t words_programmed;    // words that changed at least one bit
+  uint32_t erases;              // 1 KB blocks erased
+  uint32_t violations;          // programs that tried to turn a 0 into a 1
+  uint32_t access_errors;       // operations outside the emulated flash
+  uint64_t busy_ns;             // emulated time the flash spent busy
+} FlashEmulator_Counters;
+
+extern FlashEmulator_Counters FlashEmulator_Stats;
+
+//------------FlashEmulator_Pointer------------
+// Where the CPU reads flash address 'addr' on the host.
+// Input: addr  flash memory address inside the emulated region
+// Output: pointer into the emulated flash; aborts outside the region
+const uint8_t *FlashEmulator_Pointer(uint32_t addr);
+
+//------------FlashEmulator_Reset------------
+// Return the emulated flash to a blank chip: every byte 0xFF, the
+// controller idle, the clock and the counters at zero.
+// Input: none
+// Output: none
+void FlashEmulator_Reset(void);
+
+//------------FlashEmulator_SetTiming------------
+// Replace the timing model.
+// Input: model  function pricing each operation, 0 for the default:
+//               67.8 us per word and 33.5 us per buffered word, as
+//               measured in FlashProgram.c at 80 MHz, and 15 ms per erase
+// Output: none
+void FlashEmulator_SetTiming(FlashEmulator_Timing model);
+
+//------------FlashEmulator_Time------------
+// Emulated time the flash has been busy since the last reset.
+// Input: none
+// Output: nanoseconds
+uint64_t FlashEmulator_Time(void);
+
+//------------FlashEmulator_Register------------
+// Finish the operation in progress, then return a register of the
+// block; used by FlashProgram.c, which polls until its operation is
+// done.
+// Input: offset  byte offset of the register, as in FlashCtl_Regs
+// Output: pointer to the emulated register
+volatile uint32_t *FlashEmulator_Register(uint32_t offset);
+
+//------------FlashEmulator_Clear------------
+// Write 'bits' to FCMISC, which clears them in FCMISC and FCRIS as
+// the write-1-to-clear register of the target does.
+// Input: bits  FCMISC bits to clear
+// Output: none
+void FlashEmulator_Clear(uint32_t bits);
+
+//------------FlashEmulator_Service------------
+// Finish the operation in progress and, if interrupts are enabled,
+// run FlashCtl_Handler for it, as the hardware would.  Call from idle
+// loops that wait on FlashAsync_Pending(); WaitForInterrupt() calls it
+// too.
+// Input: none
+// Output: 1 if an operation finished, 0 if the flash was idle
+int FlashEmulator_Service(void);
+
+#endif
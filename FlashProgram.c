@@ -26,20 +26,34 @@
 
 #include <stdint.h>
 #include "FlashProgram.h"
+#include "CycleCounter.h"
+#include "FS_Instrument.h"
+#include "FS_Trace.h"
 
+#ifdef FLASH_EMULATED
+#include "FlashEmulator.h"
+// host build: every access lets the emulator finish the operation in progress
+#define FLASH_FMA_R             (*FlashEmulator_Register(0x000))
+#define FLASH_FMD_R             (*FlashEmulator_Register(0x004))
+#define FLASH_FMC_R             (*FlashEmulator_Register(0x008))
+#define FLASH_FMC2_R            (*FlashEmulator_Register(0x020))
+#define FLASH_FWBN_R            (*FlashEmulator_Register(0x100))
+#define FLASH_BOOTCFG_R         FlashEmulator_BootCfg
+#else
 #define FLASH_FMA_R             (*((volatile uint32_t *)0x400FD000))
-#define FLASH_FMA_OFFSET_MAX    0x0003FFFF  // Address Offset max
 #define FLASH_FMD_R             (*((volatile uint32_t *)0x400FD004))
 #define FLASH_FMC_R             (*((volatile uint32_t *)0x400FD008))
+#define FLASH_FMC2_R            (*((volatile uint32_t *)0x400FD020))
+#define FLASH_FWBN_R            (*((volatile uint32_t *)0x400FD100))
+#define FLASH_BOOTCFG_R         (*((volatile uint32_t *)0x400FE1D0))
+#endif
+#define FLASH_FMA_OFFSET_MAX    0x0003FFFF  // Address Offset max
 #define FLASH_FMC_WRKEY         0xA4420000  // FLASH write key (KEY bit of FLASH_BOOTCFG_R set)
 #define FLASH_FMC_WRKEY2        0x71D50000  // FLASH write key (KEY bit of FLASH_BOOTCFG_R cleared)
 #define FLASH_FMC_MERASE        0x00000004  // Mass Erase Flash Memory
 #define FLASH_FMC_ERASE         0x00000002  // Erase a Page of Flash Memory
 #define FLASH_FMC_WRITE         0x00000001  // Write a Word into Flash Memory
-#define FLASH_FMC2_R            (*((volatile uint32_t *)0x400FD020))
 #define FLASH_FMC2_WRBUF        0x00000001  // Buffered Flash Memory Write
-#define FLASH_FWBN_R            (*((volatile uint32_t *)0x400FD100))
-#define FLASH_BOOTCFG_R         (*((volatile uint32_t *)0x400FE1D0))
 #define FLASH_BOOTCFG_KEY       0x00000010  // KEY Select
 
 void DisableInterrupts(void); // Disable interrupts
@@ -48,6 +62,21 @@ long StartCritical (void);    // previous I bit, disable interrupts
 void EndCritical(long sr);    // restore I bit to previous value
 void WaitForInterrupt(void);  // low power mode
 
+static uint32_t MaskedMax[FLASH_OP_COUNT];  // longest interrupts-off time per operation
+
+// Interrupts are disabled once the flash is idle, by MaskIdle, and
+// enabled again either when the operation completes or, with
+// FLASH_BOUNDED_LATENCY, as soon as the register writes that start it
+// are done; StartCritical/EndCritical leave them disabled for a caller
+// that had already disabled them
+#ifdef FLASH_BOUNDED_LATENCY
+#define OPERATION_UNMASK(op, sr, masked)
+#define START_UNMASK(op, sr, masked)     Unmask(op, sr, masked)
+#else
+#define OPERATION_UNMASK(op, sr, masked) Unmask(op, sr, masked)
+#define START_UNMASK(op, sr, masked)
+#endif
+
 // Check if address offset is valid for write operation
 // Writing addresses must be 4-byte aligned and within range
 static int WriteAddrValid(uint32_t addr){
@@ -69,6 +98,51 @@ static int EraseAddrValid(uint32_t addr){
   // must be 1 KB aligned
   return (((addr % 1024) == 0) && (addr <= FLASH_FMA_OFFSET_MAX));
 }
+// Disable interrupts, saving the previous I bit in *sr
+// Returns the cycle count at which they were disabled
+static uint32_t Mask(long *sr){
+  *sr = StartCritical();
+  return CycleCounter_Read();
+}
+// Nonzero while a write, erase or buffered write is in progress
+static int FlashBusy(void){
+  return (FLASH_FMC_R&(FLASH_FMC_WRITE|FLASH_FMC_ERASE|FLASH_FMC_MERASE)) ||
+         (FLASH_FMC2_R&FLASH_FMC2_WRBUF);
+}
+// Wait for hardware idle, then disable interrupts, saving the previous
+// I bit in *sr.  An interrupt handler may start an operation between
+// the wait and the masking, so idle is checked again with interrupts
+// disabled; nothing else can then touch the flash registers until
+// the caller has started its operation.
+// Returns the cycle count at which interrupts were disabled
+static uint32_t MaskIdle(long *sr){
+  uint32_t masked;
+  while(1){
+    while(FlashBusy()){
+                 // to do later: return ERROR if this takes too long
+    };
+    masked = Mask(sr);
+    if(!FlashBusy()){
+      return masked;
+    }
+    EndCritical(*sr);                              // lost the race; wait again
+  }
+}
+// Restore the I bit and keep the longest time it was set for 'op'
+static void Unmask(uint8_t op, long sr, uint32_t masked){
+  masked = CycleCounter_Read() - masked;
+  EndCritical(sr);
+  if(masked > MaskedMax[op]){
+    MaskedMax[op] = masked;
+  }
+}
+// Write key expected by FMC and FMC2
+static uint32_t Key(void){
+  if(FLASH_BOOTCFG_R&FLASH_BOOTCFG_KEY){          // by default, the key is 0xA442
+    return FLASH_FMC_WRKEY;
+  }
+  return FLASH_FMC_WRKEY2;                         // otherwise, the key is 0x71D5
+}
 
 //------------Flash_Init------------
 // This function was critical to the write and erase
@@ -92,29 +166,25 @@ void Flash_Init(uint8_t systemClockFreqMHz){
 // Input: addr 4-byte aligned flash memory address to write
 //        data 32-bit data
 // Output: 'NOERROR' if successful, 'ERROR' if fail (defined in FlashProgram.h)
-// Note: disables interrupts while writing
+// Note: disables interrupts while writing (see FLASH_BOUNDED_LATENCY)
 int Flash_Write(uint32_t addr, uint32_t data){
-  uint32_t flashkey;
+  uint32_t flashkey, masked;
+  long sr;
   if(WriteAddrValid(addr)){
-    DisableInterrupts();                            // may be optional step
-                                                    // wait for hardware idle
-    while(FLASH_FMC_R&(FLASH_FMC_WRITE|FLASH_FMC_ERASE|FLASH_FMC_MERASE)){
-                 // to do later: return ERROR if this takes too long
-                 // remember to re-enable interrupts
-    };
+    FS_INSTRUMENT_START(entry);
+    flashkey = Key();
+    masked = MaskIdle(&sr);                         // wait for hardware idle
     FLASH_FMD_R = data;
     FLASH_FMA_R = addr;
-    if(FLASH_BOOTCFG_R&FLASH_BOOTCFG_KEY){          // by default, the key is 0xA442
-      flashkey = FLASH_FMC_WRKEY;
-    } else{                                         // otherwise, the key is 0x71D5
-      flashkey = FLASH_FMC_WRKEY2;
-    }
     FLASH_FMC_R = (flashkey|FLASH_FMC_WRITE);       // start writing
+    START_UNMASK(FLASH_OP_WRITE, sr, masked);
     while(FLASH_FMC_R&FLASH_FMC_WRITE){
                  // to do later: return ERROR if this takes too long
                  // remember to re-enable interrupts
     };           // wait for completion (~3 to 4 usec)
-    EnableInterrupts();
+    OPERATION_UNMASK(FLASH_OP_WRITE, sr, masked);
+    FS_TRACE_FLASH_OP(FS_TRACE_FLASH_WRITE, addr, entry);
+    FS_INSTRUMENT_STOP(FS_OP_FLASH_WRITE, entry);
     return NOERROR;
   }
   return ERROR;
@@ -127,7 +197,7 @@ int Flash_Write(uint32_t addr, uint32_t data){
 //        count  number of 32-bit writes
 // Output: number of successful writes; return value == count if completely successful
 // Note: at 80 MHz, it takes 678 usec to write 10 words
-// Note: disables interrupts while writing
+// Note: disables interrupts while writing (see FLASH_BOUNDED_LATENCY)
 int Flash_WriteArray(uint32_t *source, uint32_t addr, uint16_t count){
   uint16_t successfulWrites = 0;
   while((successfulWrites < count) && (Flash_Write(addr + 4*successfulWrites, source[successfulWrites]) == NOERROR)){
@@ -145,33 +215,30 @@ int Flash_WriteArray(uint32_t *source, uint32_t addr, uint16_t count){
 //        count  number of 32-bit writes (<=32)
 // Output: number of successful writes; return value == count if completely successful
 // Note: at 80 MHz, it takes 335 usec to write 10 words
-// Note: disables interrupts while writing
+// Note: disables interrupts while writing (see FLASH_BOUNDED_LATENCY)
 int Flash_FastWrite(uint32_t *source, uint32_t addr, uint16_t count){
-  uint32_t flashkey;
-  uint32_t volatile *FLASH_FWBn_R = (uint32_t volatile*)0x400FD100;
+  uint32_t flashkey, masked;
+  uint32_t volatile *FLASH_FWBn_R = &FLASH_FWBN_R;
   int writes = 0;
+  long sr;
   if(MassWriteAddrValid(addr)){
-    DisableInterrupts();                            // may be optional step
-    while(FLASH_FMC2_R&FLASH_FMC2_WRBUF){           // wait for hardware idle
-                 // to do later: return ERROR if this takes too long
-                 // remember to re-enable interrupts
-    };
-    while((writes < 32) && (writes < count)){
-      FLASH_FWBn_R[writes] = source[writes];
+    FS_INSTRUMENT_START(entry);
+    flashkey = Key();
+    masked = MaskIdle(&sr);                         // wait for hardware idle
+    while((writes < 32) && (writes < count)){       // fill the buffer masked, so
+      FLASH_FWBn_R[writes] = source[writes];        // no handler can overwrite it
       writes = writes + 1;
     }
     FLASH_FMA_R = addr;
-    if(FLASH_BOOTCFG_R&FLASH_BOOTCFG_KEY){          // by default, the key is 0xA442
-      flashkey = FLASH_FMC_WRKEY;
-    } else{                                         // otherwise, the key is 0x71D5
-      flashkey = FLASH_FMC_WRKEY2;
-    }
     FLASH_FMC2_R = (flashkey|FLASH_FMC2_WRBUF);     // start writing
+    START_UNMASK(FLASH_OP_FASTWRITE, sr, masked);
     while(FLASH_FMC2_R&FLASH_FMC2_WRBUF){
                  // to do later: return ERROR if this takes too long
                  // remember to re-enable interrupts
     };           // wait for completion (~3 to 4 usec)
-    EnableInterrupts();
+    OPERATION_UNMASK(FLASH_OP_FASTWRITE, sr, masked);
+    FS_TRACE_FLASH_OP(FS_TRACE_FLASH_FASTWRITE, addr, entry);
+    FS_INSTRUMENT_STOP(FS_OP_FLASH_FASTWRITE, entry);
   }
   return writes;
 }
@@ -180,29 +247,48 @@ int Flash_FastWrite(uint32_t *source, uint32_t addr, uint16_t count){
 // Erase 1 KB block of flash.
 // Input: addr 1-KB aligned flash memory address to erase
 // Output: 'NOERROR' if successful, 'ERROR' if fail (defined in FlashProgram.h)
-// Note: disables interrupts while erasing
+// Note: disables interrupts while erasing (see FLASH_BOUNDED_LATENCY)
 int Flash_Erase(uint32_t addr){
-  uint32_t flashkey;
+  uint32_t flashkey, masked;
+  long sr;
   if(EraseAddrValid(addr)){
-    DisableInterrupts();                            // may be optional step
-                                                    // wait for hardware idle
-    while(FLASH_FMC_R&(FLASH_FMC_WRITE|FLASH_FMC_ERASE|FLASH_FMC_MERASE)){
-                 // to do later: return ERROR if this takes too long
-                 // remember to re-enable interrupts
-    };
+    FS_INSTRUMENT_START(entry);
+    flashkey = Key();
+    masked = MaskIdle(&sr);                         // wait for hardware idle
     FLASH_FMA_R = addr;
-    if(FLASH_BOOTCFG_R&FLASH_BOOTCFG_KEY){          // by default, the key is 0xA442
-      flashkey = FLASH_FMC_WRKEY;
-    } else{                                         // otherwise, the key is 0x71D5
-      flashkey = FLASH_FMC_WRKEY2;
-    }
     FLASH_FMC_R = (flashkey|FLASH_FMC_ERASE);       // start erasing 1 KB block
+    START_UNMASK(FLASH_OP_ERASE, sr, masked);
     while(FLASH_FMC_R&FLASH_FMC_ERASE){
                  // to do later: return ERROR if this takes too long
                  // remember to re-enable interrupts
     };           // wait for completion (~3 to 4 usec)
-    EnableInterrupts();
+    OPERATION_UNMASK(FLASH_OP_ERASE, sr, masked);
+    FS_TRACE_FLASH_OP(FS_TRACE_FLASH_ERASE, addr, entry);
+    FS_INSTRUMENT_STOP(FS_OP_FLASH_ERASE, entry);
     return NOERROR;
   }
   return ERROR;
 }
+
+//------------Flash_MaskedCycles------------
+// Longest time one call of an operation kept interrupts disabled,
+// since reset or the last Flash_ResetMaskedCycles().
+// Input: op  FLASH_OP_WRITE, FLASH_OP_FASTWRITE or FLASH_OP_ERASE
+// Output: CPU cycles (CycleCounter_Read), 0 if never called or op invalid
+uint32_t Flash_MaskedCycles(uint8_t op){
+  if(op >= FLASH_OP_COUNT){
+    return 0;
+  }
+  return MaskedMax[op];
+}
+
+//------------Flash_ResetMaskedCycles------------
+// Forget the longest times reported by Flash_MaskedCycles().
+// Input: none
+// Output: none
+void Flash_ResetMaskedCycles(void){
+  int i;
+  for(i = 0; i < FLASH_OP_COUNT; i = i + 1){
+    MaskedMax[i] = 0;
+  }
+}
@@ -27,6 +27,19 @@
 #define ERROR                   1           // Value returned if failure
 #define NOERROR                 0           // Value returned if success
 
+// Operations timed by Flash_MaskedCycles
+#define FLASH_OP_WRITE          0           // Flash_Write
+#define FLASH_OP_FASTWRITE      1           // Flash_FastWrite
+#define FLASH_OP_ERASE          2           // Flash_Erase
+#define FLASH_OP_COUNT          3
+
+// Define FLASH_BOUNDED_LATENCY to disable interrupts only while the
+// registers that start an operation are written (for Flash_FastWrite,
+// the write buffer too), instead of for the whole operation; the
+// wait for the flash then runs with interrupts
+// enabled, so the caller's interrupt latency no longer depends on
+// the 15 ms erase time
+
 //------------Flash_Init------------
 // This function was critical to the write and erase
 // operations of the flash memory on the LM3S811
@@ -45,7 +58,7 @@ void Flash_Init(uint8_t systemClockFreqMHz);
 // Input: addr 4-byte aligned flash memory address to write
 //        data 32-bit data
 // Output: 'NOERROR' if successful, 'ERROR' if fail (defined in FlashProgram.h)
-// Note: disables interrupts while writing
+// Note: disables interrupts while writing (see FLASH_BOUNDED_LATENCY)
 int Flash_Write(uint32_t addr, uint32_t data);
 
 //------------Flash_WriteArray------------
@@ -55,7 +68,7 @@ int Flash_Write(uint32_t addr, uint32_t data);
 //        count  number of 32-bit writes
 // Output: number of successful writes; return value == count if completely successful
 // Note: at 80 MHz, it takes 678 usec to write 10 words
-// Note: disables interrupts while writing
+// Note: disables interrupts while writing (see FLASH_BOUNDED_LATENCY)
 int Flash_WriteArray(uint32_t *source, uint32_t addr, uint16_t count);
 
 //------------Flash_FastWrite------------
@@ -67,12 +80,25 @@ int Flash_WriteArray(uint32_t *source, uint32_t addr, uint16_t count);
 //        count  number of 32-bit writes (<=32)
 // Output: number of successful writes; return value == count if completely successful
 // Note: at 80 MHz, it takes 335 usec to write 10 words
-// Note: disables interrupts while writing
+// Note: disables interrupts while writing (see FLASH_BOUNDED_LATENCY)
 int Flash_FastWrite(uint32_t *source, uint32_t addr, uint16_t count);
 
 //------------Flash_Erase------------
 // Erase 1 KB block of flash.
 // Input: addr 1-KB aligned flash memory address to erase
 // Output: 'NOERROR' if successful, 'ERROR' if fail (defined in FlashProgram.h)
-// Note: disables interrupts while erasing
+// Note: disables interrupts while erasing (see FLASH_BOUNDED_LATENCY)
 int Flash_Erase(uint32_t addr);
+
+//------------Flash_MaskedCycles------------
+// Longest time one call of an operation kept interrupts disabled,
+// since reset or the last Flash_ResetMaskedCycles().
+// Input: op  FLASH_OP_WRITE, FLASH_OP_FASTWRITE or FLASH_OP_ERASE
+// Output: CPU cycles (CycleCounter_Read), 0 if never called or op invalid
+uint32_t Flash_MaskedCycles(uint8_t op);
+
+//------------Flash_ResetMaskedCycles------------
+// Forget the longest times reported by Flash_MaskedCycles().
+// Input: none
+// Output: none
+void Flash_ResetMaskedCycles(void);
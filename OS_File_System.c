@@ -3,34 +3,268 @@
 // August 9, 2020
 
 
+#include <stdint.h>
+#include <string.h>
+#ifndef FLASH_EMULATED
 #include "tm4c123gh6pm.h"
+#endif
 #include "tm4c123gh6pm_def.h"
 #include "FlashProgram.h"
+#include "FlashAsync.h"
+#include "CycleCounter.h"
+#include "OS_File_System.h"
+#include "FS_Instrument.h"
+#include "FS_Trace.h"
 
-uint32_t Sector_Size = 0x0200;
+// Sector size is fixed at compile time so that sector arithmetic
+// folds into shifts and masks; the rest of the geometry is set by
+// OS_FS_Geometry before mounting
+#define Sector_Size FS_SECTOR_SIZE
+#if FS_SECTOR_SIZE == 128
+#define Sector_Shift 7
+#elif FS_SECTOR_SIZE == 256
+#define Sector_Shift 8
+#elif FS_SECTOR_SIZE == 512
+#define Sector_Shift 9
+#elif FS_SECTOR_SIZE == 1024
+#define Sector_Shift 10
+#else
+#define Sector_Shift 11
+#endif
+#define Sector_Address(n) (Disk_Start_Address + ((uint32_t)(n) << Sector_Shift))
 uint32_t Disk_Start_Address=0x20000; // First address in the ROM
+uint32_t Disk_Sectors;            // sectors on the disk, metadata included
 
-uint8_t	RAM_Directory[256];				// Directory loaded in RAM
-uint8_t	RAM_FAT[256];							// FAT in RAM
+#define Bitmap_Words (FS_MAX_SECTORS / 32)   // words of a sector bitmap
+#define Map_Words ((Disk_Sectors + 31) >> 5) // words of a sector bitmap in use
+
+sector_t RAM_Directory[256];				// Directory loaded in RAM
+sector_t RAM_FAT[FS_MAX_SECTORS];			// FAT in RAM
 uint8_t Access_FB;                // Access Feedback
+uint32_t Free_Bitmap[Bitmap_Words];   // bit n set when sector n is free
+uint32_t Erased_Bitmap[Bitmap_Words]; // bit n set when free sector n is known to be blank
+uint32_t Dirty_Bitmap[Bitmap_Words];  // bit n set when free sector n still holds old data
+
+#define Bit_Test(map, n)  ((map)[(n) >> 5] & (1u << ((n) & 0x1F)))
+#define Bit_Set(map, n)   ((map)[(n) >> 5] |= (1u << ((n) & 0x1F)))
+#define Bit_Clear(map, n) ((map)[(n) >> 5] &= ~(1u << ((n) & 0x1F)))
+
+#define Erase_Block_Size 1024     // bytes per flash erase block
+// The file system erases one block at a time: an erase block, or one
+// sector when sectors are larger
+#define Block_Size ((Sector_Size > Erase_Block_Size) ? Sector_Size : Erase_Block_Size)
+#define Block_Sectors (Block_Size / Sector_Size)
+#define Erase_Pool_Target 8       // erased blocks OS_FS_Idle tries to keep ready
+sector_t Erasing_Sector = FS_NULL; // first sector of the block being erased in the background
+volatile int Erasing_Status;      // result of that erase, set from the flash interrupt
+OS_FS_Counters OS_FS_Stats;       // erase activity
+
+// Wear leveling: erases of every block are counted, kept with the
+// metadata, and steer allocation towards the least-worn blocks; cold
+// data is moved off young blocks once the spread exceeds Wear_Threshold
+#define FS_MAX_BLOCKS (FS_MAX_SECTORS / Block_Sectors)  // blocks of the largest disk
+#define Wear_Threshold 64         // erase spread that triggers static leveling
+#define Block_Of(n) ((n) / Block_Sectors)
+uint32_t Erase_Blocks;            // blocks on the disk
+uint32_t Block_Erases[FS_MAX_BLOCKS];  // erases of each block
+uint8_t Erase_Pending[FS_MAX_BLOCKS];  // erases not yet recorded on flash
+uint8_t Block_Live[FS_MAX_BLOCKS];     // sectors of each block that are not free
+
+// Log-structured mode: the data blocks form a circle of segments that
+// is written in order from Log_Head; a cleaner copies the live sectors
+// of the oldest segment with dead data forward and erases it, at most
+// Clean_Budget segments per append
+#define Log_Reserve 4             // erased segments kept ahead of the head
+#define Clean_Budget 2            // most segments one append cleans
+uint8_t Log_Mode;                 // set by OS_FS_Log_Mode
+sector_t Log_Head;                // sector the log writes next
+sector_t RAM_Limit[256];          // most sectors a file keeps, 0 for no limit
+uint32_t Release_Bitmap[Bitmap_Words]; // sectors freed in RAM, reusable once that is on flash
+uint32_t Tail_Bitmap[Bitmap_Words];    // last sectors of the files, gathered by allocate_sector
+
+// On-flash metadata, in two slots at the end of the disk (for the
+// default 128 KB disk, three erase blocks each: slot 0 at sectors
+// 244-249, slot 1 at 250-255):
+//   header blocks     superblock, erase counts, then a journal of changed entries
+//   directory block   one word per entry
+//   FAT blocks        one word per sector of the disk
+// An entry word holds the value and its complement, so an erased word
+// reads as FS_NULL and going from FS_NULL to a sector number only
+// clears bits: such changes are programmed in place with no erase.
+// Other changes are journaled.  A checkpoint goes to the other slot
+// under the next generation, so the previous one stays intact until it
+// is complete; mount uses the valid slot with the newest generation.
+// The sizes follow the geometry and are set by OS_FS_Geometry.
+uint32_t Meta_First_Sector;       // first sector reserved for metadata
+uint32_t Slot_Sectors;            // sectors in one metadata slot
+uint32_t Header_Sectors;          // sectors of superblock, erase counts and journal
+uint32_t Directory_Sectors;       // sectors of directory entries
+#define Slot_Sector(slot) (Meta_First_Sector + (slot) * Slot_Sectors)
+#define Journal_Sector Slot_Sector(Meta_Slot)                  // superblock/journal of the active slot
+#define Directory_Sector (Journal_Sector + Header_Sectors)     // directory entries of the active slot
+#define FAT_Sector (Directory_Sector + Directory_Sectors)      // FAT entries of the active slot
+uint8_t Meta_Slot;                // slot holding the current checkpoint
+uint8_t Standby_Erased;           // set once the other slot is known to be erased
+#define Meta_Magic 0x53464B53     // "SKFS"
+#define Meta_Version 6
+// the version word also records the sector width, the sector size and
+// the disk size, so a disk is only mounted with the geometry it was
+// formatted with
+#define Meta_Layout (Meta_Version | ((FS_SECTOR_BITS / 8) << 8) | (Sector_Shift << 10) | (Erase_Blocks << 16))
+typedef struct {
+	uint32_t magic;                 // Meta_Magic
+	uint32_t version;               // Meta_Layout
+	uint32_t generation;            // incremented by every checkpoint
+	uint32_t crc;                   // CRC-32 of the fields above
+} Meta_Header;
+
+#define Entry(value) ((uint32_t)(value) | ((uint32_t)(sector_t)~(value) << FS_SECTOR_BITS))
+uint32_t Meta_Generation;         // generation of the checkpoint on flash
+
+// After the superblock come the erase counts of every block as of the
+// checkpoint, then journal records: type, index, value and a check
+// byte, in one word with 8-bit sectors and two with 16-bit sectors; a
+// commit record closes each flush, and records after the last commit
+// are ignored at mount
+#if FS_SECTOR_BITS == 8
+typedef uint32_t record_t;
+#else
+typedef uint64_t record_t;
+#endif
+#define Journal_Records (Header_Sectors * Sector_Size / sizeof(record_t))
+#define Header_Words (sizeof(Meta_Header) / 4)
+#define Journal_First ((4 * (Header_Words + Erase_Blocks) + sizeof(record_t) - 1) / sizeof(record_t))
+#define Journal_Reserve 256       // bytes of journal a header block has at least
+#define Record_Directory 0xD1     // RAM_Directory[index] = value
+#define Record_FAT 0xFA           // RAM_FAT[index] = value
+#define Record_Erase 0xEB         // Block_Erases[index] += value
+#define Record_Commit 0xC0        // end of one flush
+#define Record_Check(type, index, value) \
+	((record_t)(uint8_t)~((type) ^ (index) ^ ((index) >> 8) ^ (value) ^ ((value) >> 8)))
+#define Record(type, index, value) \
+	((record_t)(type) | ((record_t)(index) << 8) | ((record_t)(value) << (8 + FS_SECTOR_BITS)) | \
+	 (Record_Check(type, index, value) << (8 + 2 * FS_SECTOR_BITS)))
+#define Record_Type(record) ((uint8_t)(record))
+#define Record_Index(record) ((sector_t)((record) >> 8))
+#define Record_Value(record) ((sector_t)((record) >> (8 + FS_SECTOR_BITS)))
+#define Erased_Record ((record_t)~0)
+uint32_t Dir_Journaled[8];        // entries with a record in the journal
+uint32_t FAT_Journaled[Bitmap_Words];
+uint32_t Journal_Next;            // next free journal record, 0 if the metadata cannot be updated in place
+uint32_t Dir_Dirty[8];            // bit n set when RAM_Directory[n] differs from flash
+uint32_t FAT_Dirty[Bitmap_Words]; // bit n set when RAM_FAT[n] differs from flash
+uint32_t Unlinked_Bitmap[Bitmap_Words]; // bit n set when the entry leading to sector n differs from flash
+
+// Group commit: metadata left dirty by appends is flushed after
+// Commit_Appends appends or Commit_Ms milliseconds (0 disables either),
+// or when OS_File_Flush is called
+uint16_t Commit_Appends;          // appends per commit, 0 for no limit
+uint16_t Commit_Ms;               // oldest uncommitted append may wait this long, 0 for no limit
+uint16_t Commit_Pending;          // appends since the last commit
+volatile uint16_t Commit_Age;     // milliseconds since the oldest uncommitted append
+volatile uint8_t Commit_Due;      // set by OS_FS_Tick when Commit_Ms has passed
+uint32_t Append_Sequence;         // sequence number of the latest append
+uint32_t Durable_Sequence;        // latest append whose metadata is on flash
+
+#define Index_Stride 16           // file positions between skip index entries
+sector_t RAM_Skip[FS_MAX_SECTORS]; // skip index: sector Index_Stride positions after n
+// The sectors in the skip index are those whose position plus the
+// file's offset is a multiple of Index_Stride, so dropping the first
+// sector only moves the offset
+
+// Extent map: a file is a list of extents, runs of back-to-back
+// sectors; for the first sector n of an extent, RAM_Run[n] is its
+// length and RAM_FAT[n + RAM_Run[n] - 1] the first sector of the next
+sector_t RAM_Run[FS_MAX_SECTORS];
+uint32_t Extent_Bitmap[Bitmap_Words]; // bit n set when sector n starts an extent
+
+// Reverse map, for the sectors of the files: RAM_Prev[n] is the sector
+// before n (FS_NULL for the first) and RAM_Owner[n] the file, so that
+// moving a sector patches the entry leading to it without a search
+sector_t RAM_Prev[FS_MAX_SECTORS];
+uint8_t RAM_Owner[FS_MAX_SECTORS];
+
+// Per-file descriptor kept in RAM so that the tail and length of a
+// file are known without walking RAM_FAT
+typedef struct {
+	sector_t tail;                  // last sector of the file, FS_NULL if empty
+	sector_t sectors;               // number of sectors in the file
+	sector_t checkpoint;            // last sector in the skip index
+	sector_t first_index;           // first sector in the skip index
+	sector_t offset;                // sectors dropped since the index was built, modulo Index_Stride
+	sector_t run;                   // first sector of the last extent
+	sector_t extents;               // number of extents
+} File_Descriptor;
+
+File_Descriptor RAM_Descriptor[256];  // descriptor table, indexed by file number
+
+// Open-file handle for streaming reads; remembers where in the chain
+// the previous read stopped so the next sector is one RAM_FAT lookup
+#define Max_Handles 8
+typedef struct {
+	uint8_t file;                   // file number, 255 when the handle is closed
+	sector_t sector;                // last sector read, FS_NULL before the first read
+	sector_t offset;                // position of the next sector to read
+} File_Handle;
+
+File_Handle RAM_Handle[Max_Handles];
+
+#define Burst_Words 32            // words per Flash_FastWrite (FWBn buffer)
+#define Erased_Word 0xFFFFFFFF    // value of a flash word after erase
+eDisk_Counters eDisk_Stats;       // program operations issued and saved
 
 
 void LED_Init(void);
 void LED_Red(void);
 void LED_Green(void);
 void OS_FS_Init(void);
+uint8_t OS_FS_Geometry(uint32_t, uint32_t);
 uint8_t OS_File_New( void);
-uint8_t OS_File_Size(uint8_t);
-uint8_t find_free_sector(void);
-uint8_t last_sector(uint8_t);
-void append_fat(uint8_t, uint8_t);
-uint8_t OS_File_Read( uint8_t, uint8_t, uint8_t*);
-uint8_t eDisk_WriteSector(uint8_t*, uint8_t);
+sector_t OS_File_Size(uint8_t);
+sector_t find_free_sector(void);
+sector_t last_sector(uint8_t);
+sector_t seek_sector(uint8_t, sector_t);
+void append_fat(uint8_t, sector_t);
+uint8_t OS_File_Read( uint8_t, sector_t, uint8_t[FS_SECTOR_SIZE]);
+uint8_t eDisk_WriteSector(uint8_t[FS_SECTOR_SIZE], sector_t);
+uint8_t eDisk_WriteSectorAsync(uint8_t[FS_SECTOR_SIZE], sector_t, FlashAsync_Callback, void*);
+void eDisk_ReadSector(uint8_t[FS_SECTOR_SIZE], sector_t);
+const uint8_t *OS_File_ReadPtr(uint8_t, sector_t);
+const uint8_t *OS_File_Map(uint8_t, sector_t, sector_t, uint32_t*);
+uint8_t OS_File_Open(uint8_t);
+uint8_t OS_File_ReadNext(uint8_t, uint8_t[FS_SECTOR_SIZE]);
+uint8_t OS_File_Seek(uint8_t, sector_t);
+uint8_t OS_File_Close(uint8_t);
 uint8_t OS_File_Flush( void);
 int Flash_Erase(uint32_t);
 uint8_t OS_File_Format( void);
+uint8_t OS_FS_Idle(void);
+uint16_t OS_FS_PoolDepth(void);
+uint8_t OS_FS_Mount(void);
+static const uint8_t *sector_pointer(uint32_t);
+static uint8_t program_range(uint32_t, const uint8_t*, uint32_t);
+static void rebuild_caches(void);
+static void reset_tables(void);
+static void clear_dirty(void);
+static uint8_t write_checkpoint(void);
+void WaitForInterrupt(void);  // low power mode
+static sector_t slot_erase_next(uint8_t slot);
+static uint32_t count_dirty(void);
+static uint32_t count_wear(void);
+static void count_erase(sector_t first);
+static uint8_t wear_level_step(void);
+static uint8_t clean_step(void);
+static void drop_oldest(uint8_t num);
+static void index_file(uint8_t num);
+static sector_t allocate_sector(uint8_t num);
+static uint8_t sector_ready(uint32_t n);
+static uint32_t ready_mask(uint32_t word);
+static uint32_t run_end(uint32_t n);
+static uint8_t lowest_set_bit(uint32_t word);
+static uint8_t idle_step(void);
 
 void LED_Init(void) {
+#ifndef FLASH_EMULATED
 	 //Setting up RGB output
 	SYSCTL->RCGCGPIO |= 0x20;                   // initialize clock for port F
 	while ((SYSCTL->PRGPIO & 0x20) != 0x20) {}; // wait until ready
@@ -39,31 +273,350 @@ void LED_Init(void) {
 	GPIOF->AFSEL &= ~0x0E;          // disable alternative functions PF1-PF3
 	GPIOF->DIR |= 0x0E;             // set pins PF0-PF3 as outputs	
 	GPIOF->DEN |= 0x0E;             // enable ports PF1-PF3
+#endif
 }
 
 void LED_Red(void) {
+#ifndef FLASH_EMULATED
 	// clear LED
 	GPIOF->DATA &= ~0x0E;
 	// set LED red
 	GPIOF->DATA |= 0x02;
+#endif
 }
 
 void LED_Green(void) {
+#ifndef FLASH_EMULATED
 	// clear LED
 	GPIOF->DATA &= ~0x0E;
 	// set LED green
 	GPIOF->DATA |= 0x08;
+#endif
 }
 
-// OS_FS_Init()  Temporarily initialize RAM_Directory and RAM_FAT
+// OS_FS_Init()  Mount the default disk, loading RAM_Directory and RAM_FAT
 void OS_FS_Init(void){
 	LED_Init();
+	FlashAsync_Init();
+	OS_FS_Geometry(FS_DISK_START, FS_DISK_SIZE);
+	OS_FS_Mount();
+}
+
+//******** OS_FS_Geometry************* 
+// Choose the flash region the disk occupies, before OS_FS_Mount or 
+// OS_File_Format; the metadata slots are sized to fit it 
+// The region must be memory-mapped flash made of 1 KB erase blocks; 
+// sectors are FS_SECTOR_SIZE bytes 
+// Inputs: start, first address of the disk, a multiple of 1 KB 
+//         size, bytes in the disk, a multiple of 1 KB and of the 
+//         sector size 
+// Outputs: 0 if the geometry is in use 
+// Errors: 255 if it does not fit FS_MAX_SECTORS and FS_SECTOR_BITS, 
+//         and the previous geometry is kept 
+uint8_t OS_FS_Geometry(uint32_t start, uint32_t size){
+	uint32_t sectors, blocks, header, directory, fat, slot;
+	
+	if ((start % Erase_Block_Size) != 0 || (size % Block_Size) != 0) {
+		return 255;
+	}
+	sectors = size >> Sector_Shift;
+	blocks = size / Block_Size;
+	
+	// header: superblock, one erase count per block and some journal;
+	// directory: 256 entry words; FAT: one entry word per sector
+	header = (sizeof(Meta_Header) + 4 * blocks + Journal_Reserve + Block_Size - 1) / Block_Size;
+	directory = (4 * 256 + Block_Size - 1) / Block_Size;
+	fat = (4 * sectors + Block_Size - 1) / Block_Size;
+	slot = (header + directory + fat) * Block_Sectors;
+	
+	// every data sector needs a number below FS_NULL
+	if (sectors > FS_MAX_SECTORS || sectors < 2 * slot + Block_Sectors ||
+	    sectors - 2 * slot > FS_NULL) {
+		return 255;
+	}
+	
+	FlashAsync_Wait();
+	Disk_Start_Address = start;
+	Disk_Sectors = sectors;
+	Erase_Blocks = blocks;
+	Header_Sectors = header * Block_Sectors;
+	Directory_Sectors = directory * Block_Sectors;
+	Slot_Sectors = slot;
+	Meta_First_Sector = sectors - 2 * slot;
+	Erasing_Sector = FS_NULL;
+	Journal_Next = 0;
+	return 0;
+}
+
+// Helper function crc32 continues a CRC-32 (reflected, 0xEDB88320)
+// over 'length' bytes, four bits at a time
+static uint32_t crc32(uint32_t crc, const uint8_t *data, uint32_t length){
+	static const uint32_t table[16] = {
+		0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+		0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+		0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+		0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+	};
+	
+	while (length-- > 0) {
+		crc ^= *data++;
+		crc = (crc >> 4) ^ table[crc & 0x0F];
+		crc = (crc >> 4) ^ table[crc & 0x0F];
+	}
+	return crc;
+}
+
+// Helper function meta_crc returns the checksum a superblock must carry
+static uint32_t meta_crc(const Meta_Header *header){
+	return ~crc32(0xFFFFFFFF, (const uint8_t *)header, 3 * sizeof(uint32_t));
+}
+
+// Helper function decode_entries loads 'count' entries of a table
+// from its entry words; erased or torn entries read as FS_NULL
+static void decode_entries(sector_t *table, uint32_t first_sector, uint32_t count){
+	const uint32_t *entry = (const uint32_t *)sector_pointer(first_sector);
+	uint32_t i;
+	
+	for (i = 0; i < count; ++i) {
+		if (entry[i] == Entry((sector_t)entry[i])) {
+			table[i] = (sector_t)entry[i];
+		} else {
+			table[i] = FS_NULL;
+		}
+	}
+}
+
+// Helper function tables_valid returns 1 if a directory and FAT
+// describe well-formed files: chains stay inside the data sectors,
+// never share a sector and never loop
+static uint8_t tables_valid(const sector_t *directory, const sector_t *fat){
+	uint32_t seen[Bitmap_Words] = {0};
+	sector_t ptr;
+	int i;
+	
+	for (i = 0; i < 255; ++i) {
+		ptr = directory[i];
+		while (ptr != FS_NULL) {
+			if (ptr >= Meta_First_Sector || Bit_Test(seen, ptr)) {
+				return 0;
+			}
+			Bit_Set(seen, ptr);
+			ptr = fat[ptr];
+		}
+	}
+	return 1;
+}
+
+// Helper function replay_journal applies the committed records that
+// follow the erase counts, up to the last commit record before the
+// first word that is erased or torn or the first commit record of
+// another generation than the slot's, and positions Journal_Next after
+// them; a journal with anything else after that commit (torn or
+// uncommitted records) cannot be appended to, so Journal_Next is left
+// 0 and the next flush writes a checkpoint
+static void replay_journal(void){
+	const record_t *journal = (const record_t *)sector_pointer(Journal_Sector);
+	record_t word;
+	uint32_t i, last = 0;
+	uint8_t type;
+	sector_t index, value;
+	
+	Journal_Next = 0;
+	memset(Dir_Journaled, 0, sizeof(Dir_Journaled));
+	memset(FAT_Journaled, 0, sizeof(FAT_Journaled));
+	
+	// find the last commit record of the intact part
+	last = Journal_First - 1;
+	for (i = Journal_First; i < Journal_Records; ++i) {
+		word = journal[i];
+		if (word == Erased_Record ||
+		    word != Record(Record_Type(word), Record_Index(word), Record_Value(word))) {
+			break;
+		}
+		if (Record_Type(word) == Record_Commit) {
+			if (Record_Index(word) != (sector_t)(Meta_Generation & 0xFF)) {
+				// left from an earlier checkpoint in this slot
+				break;
+			}
+			last = i;
+		}
+	}
+	
+	for (i = Journal_First; i < last; ++i) {
+		word = journal[i];
+		type = Record_Type(word);
+		index = Record_Index(word);
+		value = Record_Value(word);
+		if (type == Record_Directory && index < 255) {
+			RAM_Directory[index] = value;
+			Bit_Set(Dir_Journaled, index);
+		} else if (type == Record_FAT && index < Disk_Sectors) {
+			RAM_FAT[index] = value;
+			Bit_Set(FAT_Journaled, index);
+		} else if (type == Record_Erase && index < Erase_Blocks) {
+			Block_Erases[index] += value;
+		}
+	}
+	
+	// the rest of the journal must still be erased to take more records
+	for (i = last + 1; i < Journal_Records; ++i) {
+		if (journal[i] != Erased_Record) {
+			return;
+		}
+	}
+	Journal_Next = last + 1;
+}
+
+// Helper function slot_header returns the superblock of a slot, or 0
+// if it does not hold a valid one
+static const Meta_Header *slot_header(uint8_t slot){
+	const Meta_Header *header = (const Meta_Header *)sector_pointer(Slot_Sector(slot));
+	
+	if (header->magic == Meta_Magic && header->version == Meta_Layout &&
+	    header->crc == meta_crc(header)) {
+		return header;
+	}
+	return 0;
+}
+
+// Helper function load_wear loads the erase counts saved with the
+// checkpoint of the active slot, or zeroes them if there are none
+static void load_wear(uint8_t valid){
+	const uint32_t *count = (const uint32_t *)sector_pointer(Journal_Sector) + Header_Words;
+	uint32_t i;
+	
+	for (i = 0; i < Erase_Blocks; ++i) {
+		Block_Erases[i] = (valid && count[i] != Erased_Word) ? count[i] : 0;
+		Erase_Pending[i] = 0;
+	}
+}
+
+// Helper function load_slot makes a slot the active one and loads its
+// entries and erase counts, replaying its journal when the slot has a
+// valid superblock; returns 1 if the resulting tables are well formed
+static uint8_t load_slot(uint8_t slot){
+	const Meta_Header *header = slot_header(slot);
+	
+	Meta_Slot = slot;
+	decode_entries(RAM_Directory, Directory_Sector, 256);
+	decode_entries(RAM_FAT, FAT_Sector, Disk_Sectors);
+	load_wear(header != 0);
+	Journal_Next = 0;
+	if (header == 0) {
+		return tables_valid(RAM_Directory, RAM_FAT);
+	}
+	
+	Meta_Generation = header->generation;
+	replay_journal();
+	if (tables_valid(RAM_Directory, RAM_FAT)) {
+		return 1;
+	}
+	// the journal does not fit the entries, use the entries alone
+	decode_entries(RAM_Directory, Directory_Sector, 256);
+	decode_entries(RAM_FAT, FAT_Sector, Disk_Sectors);
+	load_wear(1);
+	Journal_Next = 0;
+	return tables_valid(RAM_Directory, RAM_FAT);
+}
+
+//******** OS_FS_Mount************* 
+// Load the directory and FAT from the metadata slot with the newest 
+// valid superblock and replay the journal of later changes 
+// If that slot is unusable the other one is tried; without a valid 
+// superblock the entries are still used when they describe 
+// well-formed files; otherwise the disk mounts empty 
+// Free sectors are checked later by OS_FS_Idle or the allocator 
+// Inputs: none 
+// Outputs: 0 if a superblock was valid, 1 if recovered, 
+//          255 if nothing usable was found 
+uint8_t OS_FS_Mount(void){
+	FS_INSTRUMENT_START(entry);
+	FS_TRACE_START(FS_OP_MOUNT, 255, 0);
+	uint32_t start = CycleCounter_Read();
+	const Meta_Header *header0 = slot_header(0);
+	const Meta_Header *header1 = slot_header(1);
+	uint8_t newest, retVal = 0;
+	
+	FlashAsync_Wait();
+	Erasing_Sector = FS_NULL;
+	Standby_Erased = 0;
+	Meta_Generation = 0;
+	
+	// newest valid slot first, the older one as fallback; a slot
+	// without a superblock may be half erased, so its entries are only
+	// used when no slot has a valid superblock
+	newest = (header1 != 0 && (header0 == 0 || header1->generation - header0->generation < 0x80000000)) ? 1 : 0;
+	if (!load_slot(newest)) {
+		retVal = 1;
+		if ((header0 == 0) != (header1 == 0) || !load_slot(1 - newest)) {
+			reset_tables();
+			clear_dirty();
+			Journal_Next = 0;
+			OS_FS_Stats.mount_cycles = CycleCounter_Read() - start;
+			FS_TRACE_END(FS_OP_MOUNT, 255, 255, FS_NULL, 0);
+			FS_INSTRUMENT_STOP(FS_OP_MOUNT, entry);
+			return 255;
+		}
+	}
+	if (header0 == 0 && header1 == 0) {
+		// recovery scan of the entries; changes go to a new checkpoint
+		retVal = 1;
+	}
+	
+	RAM_Directory[255] = FS_NULL;
+	for (int i = 0; i < Max_Handles; ++i) {
+		RAM_Handle[i].file = 255;
+	}
+	rebuild_caches();
+	clear_dirty();
 	
-  int i;
+	OS_FS_Stats.mount_cycles = CycleCounter_Read() - start;
+	FS_TRACE_END(FS_OP_MOUNT, 255, retVal, FS_NULL, 0);
+	FS_INSTRUMENT_STOP(FS_OP_MOUNT, entry);
+	return retVal;
+}
+
+// Helper function reset_tables empties the directory and FAT, closes
+// every handle and rebuilds the caches; the contents of free sectors
+// are unknown until checked
+static void reset_tables(void){
+  uint32_t i;
   for(i=0; i<256 ; i++){
-    RAM_Directory[i]=255;
-    RAM_FAT[i]=255;
+    RAM_Directory[i]=FS_NULL;
+  }
+  for(i=0; i<Disk_Sectors ; i++){
+    RAM_FAT[i]=FS_NULL;
   }
+  for(i=0; i<Max_Handles ; i++){
+    RAM_Handle[i].file=255;
+  }
+  rebuild_caches();
+}
+
+// Helper function clear_dirty marks every directory and FAT entry as
+// matching the flash, which makes every append so far durable and lets
+// sectors released since the last flush be reused
+static void clear_dirty(void){
+  uint32_t i;
+  sector_t n;
+  for(i=0; i<8 ; i++){
+    Dir_Dirty[i]=0;
+  }
+  for(i=0; i<Bitmap_Words ; i++){
+    FAT_Dirty[i]=0;
+    Unlinked_Bitmap[i]=0;
+    while(Release_Bitmap[i]){
+      n = (i<<5) + lowest_set_bit(Release_Bitmap[i]);
+      Release_Bitmap[i] &= Release_Bitmap[i]-1;
+      Bit_Set(Free_Bitmap, n);
+      Bit_Set(Dirty_Bitmap, n);
+      --Block_Live[Block_Of(n)];
+    }
+  }
+  Durable_Sequence = Append_Sequence;
+  Commit_Pending = 0;
+  Commit_Age = 0;
+  Commit_Due = 0;
 }
 
 
@@ -73,16 +626,20 @@ void OS_FS_Init(void){
 // Outputs: number of a new file 
 // Errors: return 255 on failure or disk full
 uint8_t OS_File_New(void){
+	FS_INSTRUMENT_START(entry);
+	FS_TRACE_START(FS_OP_NEW, 255, 0);
 	uint8_t new_file_number = 255;
 	for (int i = 0; i < 255; ++i)
 	{
-		if (RAM_Directory[i] == 255) {
+		if (RAM_Directory[i] == FS_NULL) {
 			// directory not full
 			new_file_number = i;
 			break;
 		}
 	}
 	
+	FS_TRACE_END(FS_OP_NEW, new_file_number, new_file_number == 255 ? 255 : 0, FS_NULL, 0);
+	FS_INSTRUMENT_STOP(FS_OP_NEW, entry);
 	return new_file_number;
 }
 
@@ -92,283 +649,1806 @@ uint8_t OS_File_New(void){
 // Inputs: num, 8-bit file number, 0 to 254 
 // Outputs: 0 if empty, otherwise the number of sectors 
 // Errors: none 
-uint8_t OS_File_Size(uint8_t num){
-	uint8_t ptr = RAM_Directory[num];
-	uint8_t size = 0;
-
-	while (ptr != 255) {
-		// one more sector in file
-		++size;
-		
-		// find next sector in file
-		ptr = RAM_FAT[ptr];
-	}
-	
+sector_t OS_File_Size(uint8_t num){
+	// length is maintained by append_fat()
+	FS_INSTRUMENT_START(entry);
+	sector_t size = RAM_Descriptor[num].sectors;
+	FS_INSTRUMENT_STOP(FS_OP_SIZE, entry);
 	return size;
 }
 
 //******** OS_File_Append************* 
-// Save 512 bytes into the file 
+// Save one sector, FS_SECTOR_SIZE bytes, into the file 
 // Inputs: num, 8-bit file number, 0 to 254 
-// buf, pointer to 512 bytes of data 
-// Outputs: 0 if successful 
-// Errors: 255 on failure or disk full 
-uint8_t OS_File_Append(uint8_t num, uint8_t buf[512]){
+// buf, pointer to FS_SECTOR_SIZE bytes of data 
+// Outputs: 0 if the sector was written and added to the file 
+// Errors: 255 if it could not be written or the disk is full; the 
+//         file is then unchanged, so the append can be retried 
+// A commit that fails after the sector is added is not reported here: 
+// OS_FS_Durable() stays behind, and OS_FS_Wait or OS_File_Flush 
+// return 255 if committing again also fails 
+uint8_t OS_File_Append(uint8_t num, uint8_t buf[FS_SECTOR_SIZE]){
+	FS_INSTRUMENT_START(entry);
+	FS_TRACE_START(FS_OP_APPEND, num, RAM_Descriptor[num].sectors);
 	LED_Red();
 	uint8_t retVal = 0;
-	uint8_t file_first_sector = RAM_Directory[num];
-	uint8_t next_free_sector = find_free_sector();
+	sector_t next_free_sector;
+	int budget;
+	
+	// bounded cleaning work before the log runs out of erased segments
+	for (budget = Clean_Budget; Log_Mode && budget > 0 && OS_FS_PoolDepth() < Log_Reserve; --budget) {
+		if (!clean_step()) {
+			break;
+		}
+	}
+	FS_INSTRUMENT_START(allocation);
+	next_free_sector = allocate_sector(num);
+	FS_INSTRUMENT_STOP(FS_OP_ALLOCATE, allocation);
 	
-	if (next_free_sector == 255) {
+	if (next_free_sector == FS_NULL) {
 		// disk is full
 		retVal = 255;
+	} else if (eDisk_WriteSector(buf, next_free_sector) != 0) {
+		// the sector stays in the free pool, but may be partly
+		// programmed, so it is erased before it is used again
+		Bit_Clear(Erased_Bitmap, next_free_sector);
+		Bit_Set(Dirty_Bitmap, next_free_sector);
+		retVal = 255;
 	} else {
-		// at least one sector still available
-		retVal = eDisk_WriteSector(buf, next_free_sector);
-		
+		// at least one sector still available, and now written
 		// update FAT
 		append_fat(num, next_free_sector);
+		if (RAM_Limit[num] != 0 && RAM_Descriptor[num].sectors > RAM_Limit[num]) {
+			drop_oldest(num);
+		}
+		
+		++Append_Sequence;
+		if (count_dirty() == 0) {
+			// the entry went in place, nothing left to commit
+			clear_dirty();
+		} else if ((++Commit_Pending >= Commit_Appends && Commit_Appends != 0) || Commit_Due) {
+			// the sector is already written and linked, so a failed
+			// commit does not fail the append: OS_FS_Durable() stays
+			// behind and the next flush or OS_FS_Wait retries it
+			OS_File_Flush();
+		}
 	}
 	
 	LED_Green();
+	FS_TRACE_END(FS_OP_APPEND, num, retVal, next_free_sector, retVal ? 0 : FS_SECTOR_SIZE);
+	FS_INSTRUMENT_STOP(FS_OP_APPEND, entry);
 	return retVal;
 }
 
-// Helper function find_free_sector returns the logical 
-// address of the first free sector
-uint8_t find_free_sector(void){
-	uint8_t free_sector_index = 255;
-	uint8_t highest_file_sector = 0;
-	
-	// get number of files in disk
-	uint8_t num_files = 0;
-	uint8_t file_num;
-	for (file_num = 0; file_num < 255; ++file_num) {
-		if (RAM_Directory[file_num] != 255) {
-			++num_files;
-		} else {
-			break;
-		}
-	}
-	
-	if (num_files == 0) {
-		// special case: no files yet, so we return first sector
-		return 0;
-	}
+// Helper function lowest_set_bit returns the position of the
+// least significant 1 in a nonzero 32-bit word
+static uint8_t lowest_set_bit(uint32_t word){
+	uint8_t position = 0;
 	
-	uint8_t ptr;
+	// binary search for the first set bit, halving the window each step
+	if ((word & 0x0000FFFF) == 0) { position += 16; word >>= 16; }
+	if ((word & 0x000000FF) == 0) { position += 8;  word >>= 8;  }
+	if ((word & 0x0000000F) == 0) { position += 4;  word >>= 4;  }
+	if ((word & 0x00000003) == 0) { position += 2;  word >>= 2;  }
+	if ((word & 0x00000001) == 0) { position += 1; }
 	
-	for (file_num = 0; file_num < num_files; ++file_num) {
-		// step through file until we reach the end
-		ptr = RAM_Directory[file_num];
-		
-		while (RAM_FAT[ptr] != 255) {
-			if (ptr > highest_file_sector) {
-				highest_file_sector = ptr;
-			}
-			
-			// move to next sector
-			ptr = RAM_FAT[ptr];
-		}
+	return position;
+}
+
+// Helper function sector_pointer returns where sector n appears in the
+// memory-mapped flash
+static const uint8_t *sector_pointer(uint32_t n){
+	return FLASH_ADDR(Sector_Address(n));
+}
+
+// Helper function mark_sector_used removes sector n from the free map
+static void mark_sector_used(sector_t n){
+	if (Bit_Test(Free_Bitmap, n)) {
+		++Block_Live[Block_Of(n)];
 	}
+	Bit_Clear(Free_Bitmap, n);
+	Bit_Clear(Erased_Bitmap, n);
+	Bit_Clear(Dirty_Bitmap, n);
+}
+
+// Helper function block_first_sector returns the first sector of the
+// erase block holding sector n
+static sector_t block_first_sector(sector_t n){
+	return n & ~(sector_t)(Block_Sectors - 1);
+}
+
+// Helper function block_is_free returns 1 if no sector of the erase
+// block starting at sector 'first' holds live data and the block is
+// not being erased in the background
+static uint8_t block_is_free(sector_t first){
+	return first != Erasing_Sector && Block_Live[Block_Of(first)] == 0;
+}
+
+// Helper function mark_block_erased records that every sector of the
+// erase block starting at sector 'first' is blank
+static void mark_block_erased(sector_t first){
+	uint32_t i;
 	
-	// return the sector immediately following
-	// the last claimed sector on the disk
-	free_sector_index = highest_file_sector + 1; 
-	
-	// used to keep track if free_sector_index changed during any iteration
-	uint8_t dirty;
+	for (i = 0; i < Block_Sectors; ++i) {
+		Bit_Set(Erased_Bitmap, first + i);
+		Bit_Clear(Dirty_Bitmap, first + i);
+	}
+}
+
+// Helper function check_sector reads free sector n and classifies it
+// as erased or dirty; returns 1 if it is blank
+static uint8_t check_sector(sector_t n){
+	const uint32_t *word = (const uint32_t *)sector_pointer(n);
+	uint32_t i;
 	
-	do {
-		dirty = 0;
-		for (file_num = 0; file_num < num_files; ++file_num) {
-			// ensure that this sector is referenced by a file in the directory
-			if (RAM_Directory[file_num] == free_sector_index) {
-				// increment to the next sector - if that sector is also
-				// referenced, the next iteration will take care of it
-				++free_sector_index;
-				++dirty;
-				continue;
-			}
-			
-			// ensure that this sector is not referenced by a sector in the FAT
-			ptr = RAM_Directory[file_num];
-			
-			while (ptr != 255) {
-				if (RAM_FAT[ptr] == free_sector_index) {
-					++free_sector_index;
-					++dirty;
-					continue;
-				}
-				
-				ptr = RAM_FAT[ptr];
-			}
+	for (i = 0; i < Sector_Size / 4; ++i) {
+		if (word[i] != Erased_Word) {
+			Bit_Set(Dirty_Bitmap, n);
+			return 0;
 		}
-	} while (dirty > 0);
-	
-	return free_sector_index;
+	}
+	Bit_Set(Erased_Bitmap, n);
+	return 1;
 }
 
-// Helper function last_sector returns the logical address
-// of the last sector assigned to the file whose number is 'start'
-uint8_t last_sector(uint8_t start){
-	// files must occupy at least one sector
-	uint8_t ptr = RAM_Directory[start];
-	while(RAM_FAT[ptr] != 255){
-			ptr = RAM_FAT[ptr];
+// Helper function settle_erase folds a finished background erase
+// into the bitmaps
+static void settle_erase(void){
+	if (Erasing_Sector != FS_NULL && FlashAsync_Pending() == 0) {
+		if (Erasing_Status == NOERROR) {
+			mark_block_erased(Erasing_Sector);
+		}
+		Erasing_Sector = FS_NULL;
 	}
-	return ptr;
 }
 
+// Completion callback for background erases, runs in the flash interrupt
+// once per erase block
+static void erase_done(void *context, int status){
+	(void)context;
+	if (status != NOERROR) {
+		Erasing_Status = status;
+	}
+}
 
-// Helper function append_fat() modifies the FAT to append 
-// the sector with logical address n to the sectors of file
-// num
-void append_fat(uint8_t num, uint8_t n){
-	// get first sector pointed to by directory entry 
-	uint8_t ptr = RAM_Directory[num];
-	uint8_t prev_ptr; // cache the last pointer used while iterating
+// Helper function erase_block erases the block starting at sector
+// 'first' while the caller waits; returns NOERROR or ERROR
+static int erase_block(sector_t first){
+	uint32_t offset;
 	
-	if (ptr == 255) {
-		// first write to file, no need to update FAT
-		RAM_Directory[num] = n;
-	} else {
-		prev_ptr = ptr;
-		ptr = RAM_FAT[ptr];
-		
-		while (ptr != 255) {
-			prev_ptr = ptr;
-			ptr = RAM_FAT[ptr];
+	FlashAsync_Wait();
+	for (offset = 0; offset < Block_Size; offset += Erase_Block_Size) {
+		if (Flash_Erase(Sector_Address(first) + offset) != NOERROR) {
+			return ERROR;
 		}
-		
-		// make previous last sector point to new last sector
-		RAM_FAT[prev_ptr] = n;
 	}
+	return NOERROR;
 }
 
-
-// eDisk_WriteSector
-// input: pointer to a 512-byte data buffer in RAM buf[512],
-//        sector logical address n
-// output: 0 if no error, 1 if error
-// use the Flash_Write function
-uint8_t eDisk_WriteSector(uint8_t buf[512], uint8_t n){
-	LED_Red();
-	uint8_t retVal = 0;
-	uint32_t physical_address;
-	uint32_t little_endian_val;
+// Helper function erase_block_async queues the erase of the block
+// starting at sector 'first', one erase block at a time, calling
+// 'callback' after each; returns NOERROR or ERROR
+static int erase_block_async(sector_t first, FlashAsync_Callback callback){
+	uint32_t offset;
 	
-	// calculate first physical address of sector
-	physical_address = Disk_Start_Address + n * Sector_Size;
-	
-	for (int i = 0; i < 128; ++i) {
-		// write buffer in 4-byte increments (512 / 4 = 128)
-		
-		// recall that TM4C123 is Little-Endian architecture
-		little_endian_val = 0;
-		
-		// byte 0 in LSB (lowest address)
-		little_endian_val |=  buf[4 * i + 0] & 0x000000FF;
-		// byte 1
-		little_endian_val |= (buf[4 * i + 1] << 8) & 0x0000FF00;
-		// byte 2
-		little_endian_val |= (buf[4 * i + 2] << 16) & 0x00FF0000;
-		// byte 3 in MSB (highest address)
-		little_endian_val |= (buf[4 * i + 3] << 24) & 0xFF000000;
-		
-		// write value to disk and check if an error occurred
-		retVal |= Flash_Write(physical_address, little_endian_val);
-		
-		// increment physical address to next 32-bit word
-		physical_address += 4;
+	for (offset = 0; offset < Block_Size; offset += Erase_Block_Size) {
+		if (FlashAsync_Erase(Sector_Address(first) + offset, callback, 0) != NOERROR) {
+			return ERROR;
+		}
 	}
-	
-	LED_Green();
-	return retVal;
+	return NOERROR;
 }
 
+// Helper function start_erase starts a background erase of the block
+// starting at sector 'first', which settle_erase folds into the bitmaps
+// once it is done; until then none of its sectors may be allocated, and
+// if the erase fails they are left to be erased again; returns 1 if it
+// was started
+static uint8_t start_erase(sector_t first){
+	uint32_t i;
+	
+	Erasing_Status = NOERROR;
+	if (erase_block_async(first, erase_done) != NOERROR) {
+		return 0;
+	}
+	for (i = 0; i < Block_Sectors; ++i) {
+		Bit_Clear(Erased_Bitmap, first + i);
+		Bit_Set(Dirty_Bitmap, first + i);
+	}
+	Erasing_Sector = first;
+	count_erase(first);
+	return 1;
+}
 
-//******** OS_File_Read************* 
-// Read 512 bytes from the file 
-// Inputs: num, 8-bit file number, 0 to 254 
-//         location, order of the sector in the file, 0 to 254 
-//         buf, pointer to 512 empty spaces in RAM 
-// Outputs: 0 if successful 
-// Errors: 255 on failure because no data 
-uint8_t OS_File_Read( uint8_t num, uint8_t location, uint8_t buf[512]){
-	uint8_t ptr = RAM_Directory[num];
-	ptr = RAM_FAT[ptr];
-	for(int i = 0; i < location ; i++){
-			if(ptr == 255){
-				return ptr;
+// Helper function least_worn_dirty_block returns the first sector of
+// the block with the fewest erases among those that hold only dead
+// data, or FS_NULL if there is none
+static sector_t least_worn_dirty_block(void){
+	uint32_t word;
+	uint32_t candidates;
+	sector_t n, first, best = FS_NULL;
+	
+	for (word = 0; word < Map_Words; ++word) {
+		candidates = Free_Bitmap[word] & Dirty_Bitmap[word];
+		while (candidates != 0) {
+			n = (word << 5) + lowest_set_bit(candidates);
+			candidates &= candidates - 1;
+			first = block_first_sector(n);
+			if (first != best && block_is_free(first) &&
+			    (best == FS_NULL || Block_Erases[Block_Of(first)] < Block_Erases[Block_Of(best)])) {
+				best = first;
 			}
-			ptr = RAM_FAT[ptr];
+		}
 	}
+	return best;
+}
 
-	uint8_t* sectorReadStart = (uint8_t*) Disk_Start_Address+(ptr*4);
-	for(int i = 0; i<512; i++){
-		buf[i] = *(sectorReadStart+i);
+// Helper function count_erase records an erase of the block starting
+// at sector 'first', to be saved with the next metadata flush
+static void count_erase(sector_t first){
+	uint32_t block = Block_Of(first);
+	
+	++Block_Erases[block];
+	if (Erase_Pending[block] < 255) {
+		++Erase_Pending[block];
 	}
-	return 0;
+	++OS_FS_Stats.erases;
 }
 
-//******** OS_File_Format************* 
-// Erase all files and all data 
-// Inputs: none 
-// Outputs: 0 if success 
-// Errors: 255 on disk write failure 
-uint8_t OS_File_Format( void){
-	LED_Red();
-  uint32_t address;
-  address = 0x00020000; // start of disk
-  while( address <= 0x00040000){
-    Flash_Erase(address); // erase 1k block
-    address = address + 1024;
-  }
-	LED_Green();
+// Helper function reclaim_sector makes a free sector programmable when
+// none is known to be erased: free sectors not looked at since mount
+// are checked first, and only if all of them hold old data is a free
+// block erased in the foreground; returns FS_NULL if the disk is full
+static sector_t reclaim_sector(void){
+	uint32_t word;
+	uint32_t candidates;
+	sector_t n, first;
+	
+	// sectors that may already be blank
+	for (word = 0; word < Map_Words; ++word) {
+		candidates = Free_Bitmap[word] & ~Erased_Bitmap[word] & ~Dirty_Bitmap[word];
+		while (candidates != 0) {
+			n = (word << 5) + lowest_set_bit(candidates);
+			candidates &= candidates - 1;
+			if (sector_ready(n)) {
+				return n;
+			}
+		}
+	}
+	
+	// the least-worn block holding only dead data, erased while the
+	// caller waits
+	first = least_worn_dirty_block();
+	for (word = 0; first == FS_NULL && word < Map_Words; ++word) {
+		if (Release_Bitmap[word] != 0) {
+			// sectors freed since the last flush become reusable with one
+			if (OS_File_Flush() == 0) {
+				first = least_worn_dirty_block();
+			}
+			break;
+		}
+	}
+	if (first == FS_NULL) {
+		return FS_NULL;
+	}
+	if (erase_block(first) != NOERROR) {
+		return FS_NULL;
+	}
+	count_erase(first);
+	++OS_FS_Stats.erase_stalls;
+	mark_block_erased(first);
+	return first;
 }
 
-//******** OS_File_Flush************* 
-// Update working buffers onto the disk 
-// Power can be removed after calling flush 
-// Inputs: none 
-// Outputs: 0 if success 
-// Errors: 255 on disk write failure 
-uint8_t OS_File_Flush(void){
-	//storing data from 254 into buffer
-	uint32_t lastDataofDisk = 0x3FC00;
-	uint32_t* lastRowData = (uint32_t*)lastDataofDisk;
-	uint32_t buf[64];
-	for(int i = 0; i < 64; i++){
-		buf[i] = *(lastRowData+(i*4));
-	}
-	//erasing last 2 sectors 254 and 255
-	Flash_Erase(0x3FC00);
-	//writing old data back into 254
-	//lastRowData = (uint32_t*)lastDataofDisk;
-	for(int i = 0; i<64; i++){
-		Flash_Write(lastDataofDisk+(i*4), buf[i]);
-	}
-	// writing directory and FAT into 255
-  uint32_t endOfDisk = 0x3FE00; 
-	uint32_t* sectorWriteStart = (uint32_t*) endOfDisk;
-	for(int i = 0; i<64; i++){
-		uint32_t data = 0;
-		data |= RAM_Directory[i*4] & 0x000000FF;
-		data |= (RAM_Directory[(i*4)+1] << 8) & 0x0000FF00;
-		data |= (RAM_Directory[(i*4)+2] << 16) & 0x00FF0000;
-		data |= (RAM_Directory[(i*4)+3] << 24) & 0xFF000000;
-		Flash_Write(endOfDisk+(i*4), data);
-	}
-	for(int i = 0; i<64; i++){
-		uint32_t data = 0;
-		data |= RAM_FAT[i*4] & 0x000000FF;
-		data |= (RAM_FAT[(i*4)+1] << 8) & 0x0000FF00;
-		data |= (RAM_FAT[(i*4)+2] << 16) & 0x00FF0000;
-		data |= (RAM_FAT[(i*4)+3] << 24) & 0xFF000000;
-		Flash_Write(endOfDisk+(i*4)+256, data);
+// Helper function move_sector copies live sector 'old' to the free,
+// erased sector n, makes the file use the copy and releases 'old', so
+// it becomes reusable with the next flush; returns 0 if success, 255 on
+// disk write failure
+// the copy is programmed straight from the memory-mapped old sector;
+// the owner and the entry that led to old come from the reverse map,
+// and only the extent and the skip index entry around old are patched
+static uint8_t move_sector(sector_t old, sector_t n){
+	uint8_t owner = RAM_Owner[old];
+	File_Descriptor *file = &RAM_Descriptor[owner];
+	sector_t prev = RAM_Prev[old];
+	sector_t next = RAM_FAT[old];
+	sector_t start, end, ptr;
+	uint32_t i;
+	
+	if (program_range(Sector_Address(n), sector_pointer(old), Sector_Size) != 0) {
+		Bit_Clear(Erased_Bitmap, n);
+		Bit_Set(Dirty_Bitmap, n);
+		return 255;
+	}
+	mark_sector_used(n);
+	
+	// the directory entry or FAT entry that led to old leads to n
+	if (prev == FS_NULL) {
+		RAM_Directory[owner] = n;
+		Bit_Set(Dir_Dirty, owner);
+	} else {
+		RAM_FAT[prev] = n;
+		Bit_Set(FAT_Dirty, prev);
+	}
+	Bit_Set(Unlinked_Bitmap, n);
+	RAM_FAT[n] = next;
+	Bit_Set(FAT_Dirty, n);
+	RAM_FAT[old] = FS_NULL;
+	Bit_Set(FAT_Dirty, old);
+	RAM_Prev[n] = prev;
+	RAM_Owner[n] = owner;
+	if (next != FS_NULL) {
+		RAM_Prev[next] = n;
+	}
+	if (file->tail == old) {
+		file->tail = n;
+	}
+	
+	// the extent holding old splits around it, and n is an extent of
+	// its own in between
+	for (start = old; !Bit_Test(Extent_Bitmap, start); --start) {
+	}
+	end = start + RAM_Run[start];
+	if (old > start) {
+		RAM_Run[start] = old - start;
+		++file->extents;
 	}
+	if (old + 1 < end) {
+		RAM_Run[old + 1] = end - old - 1;
+		Bit_Set(Extent_Bitmap, old + 1);
+		++file->extents;
+	}
+	RAM_Run[n] = 1;
+	Bit_Set(Extent_Bitmap, n);
+	if (file->run == start) {
+		file->run = (old + 1 < end) ? old + 1 : n;
+	}
+	
+	// an index entry at old moves to n, and the entry Index_Stride
+	// positions before it links to n
+	if (old == file->first_index) {
+		file->first_index = n;
+	} else if (RAM_Skip[old] != FS_NULL || old == file->checkpoint) {
+		ptr = old;
+		for (i = 0; i < Index_Stride; ++i) {
+			ptr = RAM_Prev[ptr];
+		}
+		RAM_Skip[ptr] = n;
+	}
+	if (old == file->checkpoint) {
+		file->checkpoint = n;
+	}
+	RAM_Skip[n] = RAM_Skip[old];
+	RAM_Skip[old] = FS_NULL;
+	
+	for (i = 0; i < Max_Handles; ++i) {
+		if (RAM_Handle[i].file != 255 && RAM_Handle[i].sector == old) {
+			RAM_Handle[i].sector = n;
+		}
+	}
+	
+	Bit_Set(Release_Bitmap, old);
+	++OS_FS_Stats.relocations;
 	return 0;
 }
 
+// Helper function drop_oldest removes the first sector of file num,
+// keeping a file that has reached its limit at that length; the
+// sector is reusable once the change is flushed
+static void drop_oldest(uint8_t num){
+	File_Descriptor *file = &RAM_Descriptor[num];
+	sector_t old = RAM_Directory[num];
+	int i;
+	
+	RAM_Directory[num] = RAM_FAT[old];
+	Bit_Set(Dir_Dirty, num);
+	if (RAM_Directory[num] != FS_NULL) {
+		RAM_Prev[RAM_Directory[num]] = FS_NULL;
+	}
+	RAM_FAT[old] = FS_NULL;
+	Bit_Set(FAT_Dirty, old);
+	Bit_Set(Release_Bitmap, old);
+	--file->sectors;
+	
+	// the first extent loses its first sector
+	if (RAM_Run[old] > 1) {
+		RAM_Run[old + 1] = RAM_Run[old] - 1;
+		Bit_Set(Extent_Bitmap, old + 1);
+		if (file->run == old) {
+			file->run = old + 1;
+		}
+	} else {
+		--file->extents;
+	}
+	
+	// the skip index loses its first entry if that was old
+	if (file->first_index == old) {
+		file->first_index = RAM_Skip[old];
+		if (file->checkpoint == old) {
+			file->checkpoint = FS_NULL;
+		}
+	}
+	RAM_Skip[old] = FS_NULL;
+	file->offset = (file->offset + 1) % Index_Stride;
+	
+	// positions in the file move down by one
+	for (i = 0; i < Max_Handles; ++i) {
+		if (RAM_Handle[i].file == num) {
+			if (RAM_Handle[i].sector == old) {
+				RAM_Handle[i].sector = FS_NULL;
+			}
+			if (RAM_Handle[i].offset > 0) {
+				--RAM_Handle[i].offset;
+			}
+		}
+	}
+}
 
+// Helper function clean_step cleans the oldest segment of the log that
+// holds dead data, the first one after the head (segments that are all
+// live are left in place): its live sectors are copied to the head, or
+// once the copies are committed it is erased in the background; the
+// commit is left to the group-commit policy, so segments whose copies
+// are not yet on flash are passed over; returns 1 if work was done
+static uint8_t clean_step(void){
+	uint32_t per_block = Block_Sectors;
+	uint32_t start = block_first_sector(Log_Head) + per_block;
+	uint32_t k, i;
+	sector_t first = FS_NULL, n;
+	uint32_t word;
+	uint8_t dead, live;
+	
+	settle_erase();
+	
+	// nothing to gain unless some free sector holds dead data
+	for (word = 0; word < Map_Words; ++word) {
+		if ((Free_Bitmap[word] & Dirty_Bitmap[word]) | Release_Bitmap[word]) {
+			break;
+		}
+	}
+	if (word == Map_Words) {
+		return 0;
+	}
+	
+	for (k = 0; k + per_block < Meta_First_Sector; k += per_block) {
+		first = (start + k) % Meta_First_Sector;
+		dead = 0;
+		live = 0;
+		for (i = 0; i < per_block; ++i) {
+			if ((Bit_Test(Free_Bitmap, first + i) && Bit_Test(Dirty_Bitmap, first + i)) ||
+			    Bit_Test(Release_Bitmap, first + i)) {
+				dead = 1;
+			} else if (!Bit_Test(Free_Bitmap, first + i)) {
+				live = 1;
+			}
+		}
+		if (dead && first != Erasing_Sector && (live || block_is_free(first))) {
+			break;
+		}
+	}
+	if (k + per_block >= Meta_First_Sector) {
+		return 0;
+	}
+	
+	// copy the live sectors forward
+	for (i = 0; i < per_block; ++i) {
+		if (!Bit_Test(Free_Bitmap, first + i) && !Bit_Test(Release_Bitmap, first + i)) {
+			n = find_free_sector();
+			if (n == FS_NULL || block_first_sector(n) == first || move_sector(first + i, n) != 0) {
+				return 0;
+			}
+		}
+	}
+	
+	if (block_is_free(first) && FlashAsync_Pending() == 0 && start_erase(first)) {
+		++OS_FS_Stats.segments_cleaned;
+	}
+	return 1;
+}
+
+// Helper function wear_level_step moves one sector of the live data on
+// the least-worn block to the most-worn erased sector, once the spread
+// of erase counts reaches Wear_Threshold, so that young blocks are
+// freed for new data; returns 1 if a sector was moved
+static uint8_t wear_level_step(void){
+	uint32_t per_block = Block_Sectors;
+	uint32_t first, i, most = 0;
+	uint32_t candidates;
+	sector_t n, young = FS_NULL, best = FS_NULL;
+	uint32_t word;
+	
+	if (Log_Mode) {
+		// the circular log levels wear by itself
+		return 0;
+	}
+	
+	// the youngest block holding live data, and the highest erase count
+	for (first = 0; first < Meta_First_Sector; first += per_block) {
+		if (Block_Erases[Block_Of(first)] > most) {
+			most = Block_Erases[Block_Of(first)];
+		}
+		if (Block_Live[Block_Of(first)] != 0 &&
+		    (young == FS_NULL || Block_Erases[Block_Of(first)] < Block_Erases[Block_Of(young)])) {
+			young = first;
+		}
+	}
+	if (young == FS_NULL || most - Block_Erases[Block_Of(young)] < Wear_Threshold) {
+		return 0;
+	}
+	
+	// the most-worn erased sector, if it is older than the young block
+	for (word = 0; word < Map_Words; ++word) {
+		candidates = Free_Bitmap[word] & Erased_Bitmap[word];
+		while (candidates != 0) {
+			n = (word << 5) + lowest_set_bit(candidates);
+			candidates &= candidates - 1;
+			if (best == FS_NULL || Block_Erases[Block_Of(n)] > Block_Erases[Block_Of(best)]) {
+				best = n;
+			}
+		}
+	}
+	if (best == FS_NULL || Block_Erases[Block_Of(best)] <= Block_Erases[Block_Of(young)]) {
+		return 0;
+	}
+	
+	for (i = 0; i < per_block; ++i) {
+		if (!Bit_Test(Free_Bitmap, young + i) && !Bit_Test(Release_Bitmap, young + i)) {
+			return move_sector(young + i, best) == 0 && OS_File_Flush() == 0;
+		}
+	}
+	return 0;
+}
+
+// Helper function index_sector records sector n, which has just become
+// the sector at position 'position' of the file described by 'file',
+// in the extent map and the skip index; file->tail is still the
+// sector before it
+static void index_sector(File_Descriptor *file, sector_t position, sector_t n){
+	RAM_Prev[n] = (position > 0) ? file->tail : FS_NULL;
+	RAM_Owner[n] = file - RAM_Descriptor;
+	if (position > 0 && n == file->tail + 1) {
+		// the last extent grows
+		++RAM_Run[file->run];
+		Bit_Clear(Extent_Bitmap, n);
+	} else {
+		RAM_Run[n] = 1;
+		Bit_Set(Extent_Bitmap, n);
+		file->run = n;
+		++file->extents;
+	}
+	
+	if (((position + file->offset) % Index_Stride) == 0) {
+		if (file->checkpoint != FS_NULL) {
+			// link the previous index entry forward to this one
+			RAM_Skip[file->checkpoint] = n;
+		} else {
+			file->first_index = n;
+		}
+		file->checkpoint = n;
+	}
+}
+
+// Helper function index_file recomputes the descriptor, extents and
+// skip index entries of file num by walking its chain once
+static void index_file(uint8_t num){
+	File_Descriptor *file = &RAM_Descriptor[num];
+	sector_t ptr = (num < 255) ? RAM_Directory[num] : FS_NULL;
+	
+	file->tail = FS_NULL;
+	file->sectors = 0;
+	file->checkpoint = FS_NULL;
+	file->first_index = FS_NULL;
+	file->offset = 0;
+	file->run = FS_NULL;
+	file->extents = 0;
+	while (ptr != FS_NULL) {
+		RAM_Skip[ptr] = FS_NULL;
+		index_sector(file, file->sectors, ptr);
+		file->tail = ptr;
+		++file->sectors;
+		ptr = RAM_FAT[ptr];
+	}
+}
+
+// Helper function rebuild_caches derives the free-sector bitmap, the
+// per-file descriptors and the skip index from RAM_Directory and
+// RAM_FAT; called once at mount so that allocation, append and seek
+// never walk the chains from the head again
+static void rebuild_caches(void){
+	uint32_t i;
+	sector_t ptr;
+	
+	// every data sector starts out free, with contents unknown until
+	// checked; the metadata sectors are never free
+	for (i = 0; i < Bitmap_Words; ++i) {
+		Free_Bitmap[i] = 0;
+		Erased_Bitmap[i] = 0;
+		Dirty_Bitmap[i] = 0;
+		Release_Bitmap[i] = 0;
+	}
+	for (i = 0; i < Meta_First_Sector; ++i) {
+		Bit_Set(Free_Bitmap, i);
+	}
+	for (i = 0; i < Erase_Blocks; ++i) {
+		Block_Live[i] = (i < Block_Of(Meta_First_Sector)) ? 0 : Block_Sectors;
+	}
+	
+	for (i = 0; i < Disk_Sectors; ++i) {
+		RAM_Skip[i] = FS_NULL;
+	}
+	
+	// claim each sector reachable from the directory, then record the
+	// tail, length and index entries of every file
+	for (i = 0; i < 255; ++i) {
+		ptr = RAM_Directory[i];
+		while (ptr != FS_NULL) {
+			mark_sector_used(ptr);
+			ptr = RAM_FAT[ptr];
+		}
+	}
+	
+	// a free sector may still carry a link left on flash by a file
+	// that was truncated or deleted; the next checkpoint writes these
+	// out as FS_NULL
+	for (i = 0; i < Meta_First_Sector; ++i) {
+		if (Bit_Test(Free_Bitmap, i)) {
+			RAM_FAT[i] = FS_NULL;
+		}
+	}
+	for (i = 0; i < 256; ++i) {
+		index_file(i);
+	}
+}
+
+// Helper function find_free_sector returns the logical 
+// address of a free, erased sector in the least-worn block that has
+// one (the first such sector on a tie), or in log mode the next one
+// after the head; FS_NULL if the disk is full
+sector_t find_free_sector(void){
+	uint32_t word;
+	uint32_t candidates;
+	sector_t n, best = FS_NULL;
+	
+	settle_erase();
+	
+	if (Log_Mode) {
+		// the next erased sector from the head, in circular order
+		for (word = 0; word < Meta_First_Sector; ++word) {
+			n = (Log_Head + word) % Meta_First_Sector;
+			if (Bit_Test(Free_Bitmap, n) && Bit_Test(Erased_Bitmap, n)) {
+				Log_Head = (n + 1) % Meta_First_Sector;
+				return n;
+			}
+		}
+		return reclaim_sector();
+	}
+	
+	// skip 32 unavailable sectors at a time
+	for (word = 0; word < Map_Words; ++word) {
+		candidates = Free_Bitmap[word] & Erased_Bitmap[word];
+		while (candidates != 0) {
+			n = (word << 5) + lowest_set_bit(candidates);
+			candidates &= candidates - 1;
+			if (best == FS_NULL || Block_Erases[Block_Of(n)] < Block_Erases[Block_Of(best)]) {
+				best = n;
+			}
+		}
+	}
+	if (best != FS_NULL) {
+		return best;
+	}
+	
+	return reclaim_sector();
+}
+
+// Helper function sector_ready returns 1 if sector n is a free, erased
+// data sector, checking its contents if they are not known yet; the
+// erased sectors of an empty block that also holds dead data are left
+// until the block is erased whole, or that dead data would be stranded
+static uint8_t sector_ready(uint32_t n){
+	uint32_t first = block_first_sector(n), i;
+	
+	if (n >= Meta_First_Sector || !Bit_Test(Free_Bitmap, n) || Bit_Test(Dirty_Bitmap, n) ||
+	    first == Erasing_Sector) {
+		return 0;
+	}
+	if (Block_Live[Block_Of(first)] == 0) {
+		for (i = first; i < first + Block_Sectors; ++i) {
+			if (!Bit_Test(Erased_Bitmap, i) && (Bit_Test(Dirty_Bitmap, i) || !check_sector(i))) {
+				return 0;
+			}
+		}
+	}
+	return Bit_Test(Erased_Bitmap, n) || check_sector(n);
+}
+
+// Helper function ready_mask returns the sectors of bitmap word 'word'
+// that may be ready: free sectors that are erased or not checked yet,
+// outside the block being erased and outside empty blocks that also
+// hold dead data (see sector_ready)
+static uint32_t ready_mask(uint32_t word){
+	uint32_t mask = Free_Bitmap[word] & ~Dirty_Bitmap[word];
+	uint32_t dead = Free_Bitmap[word] & Dirty_Bitmap[word];
+	uint32_t block = (1u << Block_Sectors) - 1;
+	uint32_t i;
+	
+	if (dead != 0 || (Erasing_Sector >> 5) == word) {
+		for (i = 0; i < 32; i += Block_Sectors) {
+			if ((word << 5) + i == Erasing_Sector ||
+			    (((dead >> i) & block) != 0 && Block_Live[Block_Of((word << 5) + i)] == 0)) {
+				mask &= ~(block << i);
+			}
+		}
+	}
+	return mask;
+}
+
+// Helper function run_end returns the first sector after n that
+// ready_mask leaves out
+static uint32_t run_end(uint32_t n){
+	uint32_t word = n >> 5;
+	uint32_t gaps = ~ready_mask(word) & (~0u << (n & 0x1F));
+	
+	// whole words of ready sectors at a time
+	while (gaps == 0) {
+		gaps = ~ready_mask(++word);
+	}
+	return (word << 5) + lowest_set_bit(gaps);
+}
+
+// Helper function allocate_sector picks the sector file num appends
+// next: the one right after its tail when that is ready, so the last
+// extent grows; otherwise a new extent begins in the least-worn block
+// that has ready sectors, at the longest run of them there; a run that
+// directly follows a file's tail is entered at its middle, leaving
+// that file room to grow; in log mode the log order wins
+// Runs are found in the bitmaps a word at a time, and only the sector
+// picked is checked for old data, the search starting over if it has any
+static sector_t allocate_sector(uint8_t num){
+	sector_t tail = RAM_Descriptor[num].tail;
+	uint32_t n, start, end, best, best_length;
+	uint32_t mask, i;
+	
+	settle_erase();
+	if (Log_Mode) {
+		return find_free_sector();
+	}
+	if (tail != FS_NULL && sector_ready(tail + 1)) {
+		return tail + 1;
+	}
+	
+	// the tails of all files, from their descriptors
+	memset(Tail_Bitmap, 0, sizeof(Tail_Bitmap));
+	for (i = 0; i < 255; ++i) {
+		if (RAM_Descriptor[i].tail != FS_NULL) {
+			Bit_Set(Tail_Bitmap, RAM_Descriptor[i].tail);
+		}
+	}
+	
+	do {
+		best = FS_NULL;
+		best_length = 0;
+		for (n = 0; n < Meta_First_Sector; n = end) {
+			mask = ready_mask(n >> 5) & (~0u << (n & 0x1F));
+			if (mask == 0) {
+				end = (n | 0x1F) + 1;
+				continue;
+			}
+			n = (n & ~0x1Fu) + lowest_set_bit(mask);
+			end = run_end(n);
+			start = n;
+			if (n > 0 && Bit_Test(Tail_Bitmap, n - 1)) {
+				start = n + (end - n) / 2;
+			}
+			if (best == FS_NULL || Block_Erases[Block_Of(start)] < Block_Erases[Block_Of(best)] ||
+			    (Block_Erases[Block_Of(start)] == Block_Erases[Block_Of(best)] && end - start > best_length)) {
+				best = start;
+				best_length = end - start;
+			}
+		}
+		if (best == FS_NULL) {
+			return reclaim_sector();
+		}
+	} while (!sector_ready(best));
+	return best;
+}
+
+// Helper function last_sector returns the logical address
+// of the last sector assigned to the file whose number is 'start'
+sector_t last_sector(uint8_t start){
+	// tail is maintained by append_fat(), FS_NULL if the file is empty
+	return RAM_Descriptor[start].tail;
+}
+
+
+// Helper function seek_sector returns the logical address of the
+// sector at position 'location' of file num, or FS_NULL if the file
+// is shorter than that; costs one hop per extent when the file has
+// fewer than Index_Stride extents, otherwise at most
+// location/Index_Stride skip hops plus 2*(Index_Stride-1) FAT hops
+sector_t seek_sector(uint8_t num, sector_t location){
+	File_Descriptor *file = &RAM_Descriptor[num];
+	sector_t ptr, first;
+	
+	if (location >= file->sectors) {
+		// no data at this position
+		return FS_NULL;
+	}
+	
+	if (location == file->sectors - 1) {
+		// newest sector, typical when tailing a log
+		return file->tail;
+	}
+	
+	ptr = RAM_Directory[num];
+	if (file->extents < Index_Stride) {
+		// whole extents at a time, then arithmetic inside the extent
+		while (location >= RAM_Run[ptr]) {
+			location -= RAM_Run[ptr];
+			ptr = RAM_FAT[ptr + RAM_Run[ptr] - 1];
+		}
+		return ptr + location;
+	}
+	
+	// badly fragmented: fine hops along the FAT up to the first index
+	// entry, coarse hops along the skip index, then fine hops again
+	first = (Index_Stride - file->offset) % Index_Stride;
+	if (location >= first && file->first_index != FS_NULL) {
+		ptr = file->first_index;
+		location -= first;
+	}
+	while (location >= Index_Stride) {
+		ptr = RAM_Skip[ptr];
+		location -= Index_Stride;
+	}
+	while (location > 0) {
+		ptr = RAM_FAT[ptr];
+		--location;
+	}
+	
+	return ptr;
+}
+
+
+// Helper function entry_erased returns 1 if entry 'index' of the
+// table whose entry words start at first_sector reads as FS_NULL on
+// flash and may be programmed in place: the word is still erased and
+// the entry has neither a journal record nor a pending change
+static uint8_t entry_erased(uint32_t *dirty, uint32_t *journaled, uint32_t first_sector,
+                            sector_t index){
+	const uint32_t *entry = (const uint32_t *)sector_pointer(first_sector) + index;
+	
+	return *entry == Erased_Word && !Bit_Test(journaled, index) && !Bit_Test(dirty, index);
+}
+
+// Helper function persist_entry records that entry 'index' of the
+// table whose entry words start at first_sector is now 'value'; when
+// 'linkable' is set and the entry is still erased on flash and never
+// journaled, it is programmed right away with a single word write (a
+// journal record would override it at mount), any other change is
+// left dirty for the journal; returns 1 if the entry went in place
+static uint8_t persist_entry(uint32_t *dirty, uint32_t *journaled, uint32_t first_sector,
+                             sector_t index, sector_t value, uint8_t linkable){
+	uint32_t address = Sector_Address(first_sector) + 4 * index;
+	uint32_t word = Entry(value);
+	
+	if (linkable && Journal_Next != 0 && value != FS_NULL &&
+	    entry_erased(dirty, journaled, first_sector, index) &&
+	    program_range(address, (uint8_t *)&word, 4) == 0) {
+		++OS_FS_Stats.inplace_writes;
+		return 1;
+	}
+	Bit_Set(dirty, index);
+	return 0;
+}
+
+
+// Helper function append_fat() modifies the FAT to append 
+// the sector with logical address n to the sectors of file
+// num; the link to n only goes in place when a mount would find
+// it: the sector it is written from is itself reached on flash, and
+// n's own entry reads as the end of the chain there
+void append_fat(uint8_t num, sector_t n){
+	File_Descriptor *file = &RAM_Descriptor[num];
+	uint8_t linkable;
+	uint8_t linked;
+	
+	// sector n is no longer available for allocation, and ends the file;
+	// a link left on flash by a previous owner is journaled as FS_NULL
+	mark_sector_used(n);
+	RAM_FAT[n] = FS_NULL;
+	linkable = entry_erased(FAT_Dirty, FAT_Journaled, FAT_Sector, n);
+	if (!linkable) {
+		Bit_Set(FAT_Dirty, n);
+	}
+	
+	if (file->tail == FS_NULL) {
+		// first write to file, no need to update FAT
+		RAM_Directory[num] = n;
+		linked = persist_entry(Dir_Dirty, Dir_Journaled, Directory_Sector, num, n, linkable);
+	} else {
+		// make previous last sector point to new last sector
+		RAM_FAT[file->tail] = n;
+		linked = persist_entry(FAT_Dirty, FAT_Journaled, FAT_Sector, file->tail, n,
+		                       linkable && !Bit_Test(Unlinked_Bitmap, file->tail));
+	}
+	if (!linked) {
+		Bit_Set(Unlinked_Bitmap, n);
+	}
+	
+	index_sector(file, file->sectors, n);
+	file->tail = n;
+	++file->sectors;
+}
+
+
+// Helper function pack_word assembles four bytes of a RAM buffer
+// into the 32-bit value that Flash_Write expects
+static uint32_t pack_word(const uint8_t bytes[4]){
+	// recall that TM4C123 is Little-Endian architecture
+	uint32_t little_endian_val = 0;
+	
+	// byte 0 in LSB (lowest address)
+	little_endian_val |=  bytes[0] & 0x000000FF;
+	// byte 1
+	little_endian_val |= (bytes[1] << 8) & 0x0000FF00;
+	// byte 2
+	little_endian_val |= (bytes[2] << 16) & 0x00FF0000;
+	// byte 3 in MSB (highest address)
+	little_endian_val |= (bytes[3] << 24) & 0xFF000000;
+	
+	return little_endian_val;
+}
+
+
+// Helper function program_range copies 'bytes' bytes (a multiple of 4)
+// from buf into erased flash starting at physical_address; returns 0
+// if no error, otherwise bit b is set if burst b (bytes 128*b to
+// 128*b+127), or burst b+8, b+16 and so on, failed to program
+// uses Flash_FastWrite in 32-word bursts through the write buffer,
+// falling back to Flash_Write when a burst is not 128-byte aligned;
+// the flash must be erased, so words equal to Erased_Word are left
+// alone and a burst that is entirely erased is not programmed at all
+static uint8_t program_range(uint32_t physical_address, const uint8_t *buf, uint32_t bytes){
+	uint8_t retVal = 0;
+	uint32_t words[Burst_Words];
+	int burst, i, size, count;
+	
+	// the flash cannot program while a background erase is running
+	if (FlashAsync_Pending()) {
+		++OS_FS_Stats.erase_waits;
+		FlashAsync_Wait();
+	}
+	
+	for (burst = 0; bytes > 0; ++burst) {
+		// pack the next 128 bytes into words, remembering how many
+		// words are needed to reach the last programmed one
+		size = (bytes < 4 * Burst_Words) ? bytes / 4 : Burst_Words;
+		count = 0;
+		for (i = 0; i < size; ++i) {
+			words[i] = pack_word(&buf[4 * (burst * Burst_Words + i)]);
+			if (words[i] != Erased_Word) {
+				count = i + 1;
+			}
+		}
+		
+		if ((physical_address % (4 * Burst_Words)) == 0) {
+			eDisk_Stats.words_skipped += size - count;
+			if (count == 0) {
+				// nothing to program in this burst
+				++eDisk_Stats.ops_saved;
+			} else {
+				// one buffered program operation, trailing erased words trimmed
+				++eDisk_Stats.program_ops;
+				if (Flash_FastWrite(words, physical_address, count) != count) {
+					retVal |= 1 << (burst % 8);
+				}
+			}
+		} else {
+			// unaligned layout, program one word at a time
+			for (i = 0; i < size; ++i) {
+				if (words[i] == Erased_Word) {
+					++eDisk_Stats.words_skipped;
+					++eDisk_Stats.ops_saved;
+					continue;
+				}
+				++eDisk_Stats.program_ops;
+				if (Flash_Write(physical_address + 4 * i, words[i]) != NOERROR) {
+					retVal |= 1 << (burst % 8);
+				}
+			}
+		}
+		
+		// move on to the next 128 bytes
+		physical_address += 4 * size;
+		bytes -= 4 * size;
+	}
+	
+	return retVal;
+}
+
+
+// eDisk_WriteSector
+// input: pointer to a data buffer of one sector in RAM buf[FS_SECTOR_SIZE],
+//        sector logical address n
+// output: 0 if no error, otherwise bit b is set if burst b
+//         (bytes 128*b to 128*b+127), or b+8, failed to program
+// the sector must be erased; see program_range
+uint8_t eDisk_WriteSector(uint8_t buf[FS_SECTOR_SIZE], sector_t n){
+	LED_Red();
+	uint8_t retVal;
+	
+	// calculate first physical address of sector
+	retVal = program_range(Sector_Address(n), buf, Sector_Size);
+	
+	LED_Green();
+	return retVal;
+}
+
+
+// eDisk_WriteSectorAsync
+// input: pointer to a data buffer of one sector in RAM buf[FS_SECTOR_SIZE],
+//        sector logical address n,
+//        function run from the flash interrupt once the sector
+//        is programmed, and a pointer handed back to it
+// output: 0 if queued, 1 if the flash request queue is full
+// returns immediately; buf must not change until callback runs
+uint8_t eDisk_WriteSectorAsync(uint8_t buf[FS_SECTOR_SIZE], sector_t n,
+                               FlashAsync_Callback callback, void *context){
+	uint32_t physical_address = Sector_Address(n);
+	
+	if (FlashAsync_Program(physical_address, buf, Sector_Size / 4, callback, context) != NOERROR) {
+		return 1;
+	}
+	return 0;
+}
+
+
+//******** OS_File_Read************* 
+// Read one sector, FS_SECTOR_SIZE bytes, from the file 
+// Inputs: num, 8-bit file number, 0 to 254 
+//         location, order of the sector in the file, from 0 
+//         buf, pointer to FS_SECTOR_SIZE empty spaces in RAM 
+// Outputs: 0 if successful 
+// Errors: 255 on failure because no data 
+uint8_t OS_File_Read( uint8_t num, sector_t location, uint8_t buf[FS_SECTOR_SIZE]){
+	FS_INSTRUMENT_START(entry);
+	FS_TRACE_START(FS_OP_READ, num, location);
+	sector_t ptr = seek_sector(num, location);
+	if(ptr == FS_NULL){
+		FS_TRACE_END(FS_OP_READ, num, 255, FS_NULL, 0);
+		FS_INSTRUMENT_STOP(FS_OP_READ, entry);
+		return 255;
+	}
+
+	eDisk_ReadSector(buf, ptr);
+	FS_TRACE_END(FS_OP_READ, num, 0, ptr, FS_SECTOR_SIZE);
+	FS_INSTRUMENT_STOP(FS_OP_READ, entry);
+	return 0;
+}
+
+
+// eDisk_ReadSector
+// input: pointer to an empty buffer of one sector in RAM buf[FS_SECTOR_SIZE],
+//        sector logical address n
+// output: none
+void eDisk_ReadSector(uint8_t buf[FS_SECTOR_SIZE], sector_t n){
+	// constant length, so the copy is unrolled into word moves
+	memcpy(buf, sector_pointer(n), Sector_Size);
+}
+
+
+//******** OS_File_ReadPtr************* 
+// Locate a sector of the file in memory-mapped flash, without copying 
+// The pointer stays valid as long as the file exists 
+// Inputs: num, 8-bit file number, 0 to 254 
+//         location, order of the sector in the file, from 0 
+// Outputs: pointer to the FS_SECTOR_SIZE bytes of the sector 
+// Errors: 0 (null pointer) because no data 
+const uint8_t *OS_File_ReadPtr(uint8_t num, sector_t location){
+	FS_INSTRUMENT_START(entry);
+	sector_t ptr = seek_sector(num, location);
+	if(ptr == FS_NULL){
+		FS_INSTRUMENT_STOP(FS_OP_READPTR, entry);
+		return 0;
+	}
+	FS_INSTRUMENT_STOP(FS_OP_READPTR, entry);
+	return sector_pointer(ptr);
+}
+
+
+//******** OS_File_Map************* 
+// Locate a run of sectors of the file that lie back to back in 
+// memory-mapped flash, so they can be parsed without copying 
+// The pointer stays valid as long as the file exists 
+// Inputs: num, 8-bit file number, 0 to 254 
+//         location, order of the first sector in the file, from 0 
+//         count, largest number of sectors wanted 
+//         length, where to store the number of bytes mapped 
+// Outputs: pointer to the first byte; *length is a multiple of 
+//          FS_SECTOR_SIZE 
+//          and covers 1 to count sectors 
+// Errors: 0 (null pointer) and *length = 0 because no data 
+const uint8_t *OS_File_Map(uint8_t num, sector_t location, sector_t count, uint32_t *length){
+	FS_INSTRUMENT_START(entry);
+	sector_t ptr = seek_sector(num, location);
+	sector_t run = 1;
+	
+	if(ptr == FS_NULL || count == 0){
+		*length = 0;
+		FS_INSTRUMENT_STOP(FS_OP_MAP, entry);
+		return 0;
+	}
+	
+	// extend the run while the next sector of the file is the next
+	// sector on the disk
+	while (run < count && RAM_FAT[ptr] == ptr + 1) {
+		++ptr;
+		++run;
+	}
+	
+	*length = (uint32_t)run << Sector_Shift;
+	FS_INSTRUMENT_STOP(FS_OP_MAP, entry);
+	return sector_pointer(ptr + 1 - run);
+}
+
+
+//******** OS_File_Open************* 
+// Open a file for sequential reading from its first sector 
+// Several handles may be open on the same file at once 
+// Inputs: num, 8-bit file number, 0 to 254 
+// Outputs: handle number, 0 to Max_Handles-1 
+// Errors: 255 if every handle is in use 
+uint8_t OS_File_Open(uint8_t num){
+	FS_INSTRUMENT_START(entry);
+	for (uint8_t h = 0; h < Max_Handles; ++h) {
+		if (RAM_Handle[h].file == 255) {
+			RAM_Handle[h].file = num;
+			RAM_Handle[h].sector = FS_NULL;
+			RAM_Handle[h].offset = 0;
+			FS_INSTRUMENT_STOP(FS_OP_OPEN, entry);
+			return h;
+		}
+	}
+	
+	FS_INSTRUMENT_STOP(FS_OP_OPEN, entry);
+	return 255;
+}
+
+
+//******** OS_File_ReadNext************* 
+// Read the next sector, FS_SECTOR_SIZE bytes, from an open file 
+// Sectors appended after the handle reached the end become readable 
+// Inputs: handle, number returned by OS_File_Open 
+//         buf, pointer to FS_SECTOR_SIZE empty spaces in RAM 
+// Outputs: 0 if successful 
+// Errors: 255 at end of file or if the handle is not open 
+uint8_t OS_File_ReadNext(uint8_t handle, uint8_t buf[FS_SECTOR_SIZE]){
+	FS_INSTRUMENT_START(entry);
+	FS_TRACE_START(FS_OP_READNEXT, 255, handle);
+	File_Handle *h;
+	sector_t next;
+	
+	if (handle >= Max_Handles || RAM_Handle[handle].file == 255) {
+		FS_TRACE_END(FS_OP_READNEXT, 255, 255, FS_NULL, 0);
+		FS_INSTRUMENT_STOP(FS_OP_READNEXT, entry);
+		return 255;
+	}
+	h = &RAM_Handle[handle];
+	
+	// one lookup from the cached chain position
+	if (h->sector == FS_NULL) {
+		next = RAM_Directory[h->file];
+	} else {
+		next = RAM_FAT[h->sector];
+	}
+	
+	if (next == FS_NULL) {
+		// end of file, for now
+		FS_TRACE_END(FS_OP_READNEXT, h->file, 255, FS_NULL, 0);
+		FS_INSTRUMENT_STOP(FS_OP_READNEXT, entry);
+		return 255;
+	}
+	
+	eDisk_ReadSector(buf, next);
+	h->sector = next;
+	++h->offset;
+	FS_TRACE_END(FS_OP_READNEXT, h->file, 0, next, FS_SECTOR_SIZE);
+	FS_INSTRUMENT_STOP(FS_OP_READNEXT, entry);
+	return 0;
+}
+
+
+//******** OS_File_Seek************* 
+// Move an open handle so the next read returns sector 'location' 
+// Inputs: handle, number returned by OS_File_Open 
+//         location, order of the sector in the file, 0 to file size 
+// Outputs: 0 if successful 
+// Errors: 255 if past the end of file or the handle is not open 
+uint8_t OS_File_Seek(uint8_t handle, sector_t location){
+	FS_INSTRUMENT_START(entry);
+	File_Handle *h;
+	
+	if (handle >= Max_Handles || RAM_Handle[handle].file == 255) {
+		FS_INSTRUMENT_STOP(FS_OP_SEEK, entry);
+		return 255;
+	}
+	h = &RAM_Handle[handle];
+	
+	if (location > RAM_Descriptor[h->file].sectors) {
+		FS_INSTRUMENT_STOP(FS_OP_SEEK, entry);
+		return 255;
+	}
+	
+	// remember the sector before 'location' so ReadNext follows it
+	h->sector = (location == 0) ? FS_NULL : seek_sector(h->file, location - 1);
+	h->offset = location;
+	FS_INSTRUMENT_STOP(FS_OP_SEEK, entry);
+	return 0;
+}
+
+
+//******** OS_File_Close************* 
+// Release a handle returned by OS_File_Open 
+// Inputs: handle, number returned by OS_File_Open 
+// Outputs: 0 if successful 
+// Errors: 255 if the handle is not open 
+uint8_t OS_File_Close(uint8_t handle){
+	FS_INSTRUMENT_START(entry);
+	if (handle >= Max_Handles || RAM_Handle[handle].file == 255) {
+		FS_INSTRUMENT_STOP(FS_OP_CLOSE, entry);
+		return 255;
+	}
+	
+	RAM_Handle[handle].file = 255;
+	FS_INSTRUMENT_STOP(FS_OP_CLOSE, entry);
+	return 0;
+}
+
+//******** OS_File_Format************* 
+// Erase all files and all data, and forget the OS_File_Limit of 
+// every file number 
+// Only an empty checkpoint is written here; the other blocks are
+// erased by OS_FS_Idle, or on demand when space runs out 
+// Inputs: none 
+// Outputs: 0 if success 
+// Errors: 255 on disk write failure 
+uint8_t OS_File_Format( void){
+	FS_INSTRUMENT_START(entry);
+	FS_TRACE_START(FS_OP_FORMAT, 255, 0);
+	int i;
+	LED_Red();
+	FlashAsync_Wait();
+	Erasing_Sector = FS_NULL;
+	reset_tables();
+	clear_dirty();
+	for (i = 0; i < 256; ++i) {
+		RAM_Limit[i] = 0;
+	}
+	
+	// an empty checkpoint, so appends can be persisted in place
+	if (write_checkpoint() != 0) {
+		LED_Green();
+		FS_TRACE_END(FS_OP_FORMAT, 255, 255, FS_NULL, 0);
+		FS_INSTRUMENT_STOP(FS_OP_FORMAT, entry);
+		return 255;
+	}
+	LED_Green();
+	FS_TRACE_END(FS_OP_FORMAT, 255, 0, FS_NULL, 0);
+	FS_INSTRUMENT_STOP(FS_OP_FORMAT, entry);
+	return 0;
+}
+
+//******** OS_FS_Idle************* 
+// Background upkeep: commits metadata when the group-commit timer 
+// says so, erases the standby metadata slot, checks free 
+// sectors whose contents are unknown, starts a flash-interrupt 
+// driven erase of the least-worn block that holds only dead data, 
+// cleans the log in log mode, moves cold data off young blocks and 
+// saves the erase counts 
+// Call from the idle loop or a low-priority task 
+// Inputs: none 
+// Outputs: 1 if work was done or is in progress, 0 if idle 
+uint8_t OS_FS_Idle(void){
+	FS_INSTRUMENT_START(entry);
+	uint8_t busy = idle_step();
+	FS_INSTRUMENT_STOP(FS_OP_IDLE, entry);
+	return busy;
+}
+
+// Helper function idle_step does one piece of the upkeep described 
+// at OS_FS_Idle 
+static uint8_t idle_step(void){
+	uint32_t word;
+	uint32_t candidates;
+	sector_t first;
+	
+	settle_erase();
+	if (Commit_Due) {
+		OS_File_Flush();
+		return 1;
+	}
+	if (FlashAsync_Pending()) {
+		return 1;
+	}
+	
+	// erase the standby metadata slot, so the next checkpoint needs none
+	if (!Standby_Erased) {
+		first = slot_erase_next(1 - Meta_Slot);
+		if (first == FS_NULL) {
+			Standby_Erased = 1;
+		} else {
+			if (erase_block_async(first, 0) == NOERROR) {
+				count_erase(first);
+			}
+			return 1;
+		}
+	}
+	
+	// check one free sector whose contents are unknown
+	for (word = 0; word < Map_Words; ++word) {
+		candidates = Free_Bitmap[word] & ~Erased_Bitmap[word] & ~Dirty_Bitmap[word];
+		if (candidates != 0) {
+			check_sector((word << 5) + lowest_set_bit(candidates));
+			return 1;
+		}
+	}
+	
+	// clean the log ahead of the appends that would otherwise do it;
+	// once only segments whose copies wait for a commit are left,
+	// commit them so they can be erased next time
+	if (Log_Mode && OS_FS_PoolDepth() < 2 * Log_Reserve) {
+		if (clean_step()) {
+			return 1;
+		}
+		for (word = 0; word < Map_Words; ++word) {
+			if (Release_Bitmap[word] != 0) {
+				OS_File_Flush();
+				return 1;
+			}
+		}
+	}
+	
+	// start erasing the least-worn block that holds only dead data
+	if (OS_FS_PoolDepth() < Erase_Pool_Target) {
+		first = least_worn_dirty_block();
+		if (first != FS_NULL) {
+			start_erase(first);
+			return 1;
+		}
+	}
+	
+	// move one sector of cold data, then save the erase counts
+	if (wear_level_step()) {
+		return 1;
+	}
+	if (count_wear() != 0) {
+		OS_File_Flush();
+		return 1;
+	}
+	
+	return 0;
+}
+
+//******** OS_FS_PoolDepth************* 
+// Count erase blocks that are free and already erased 
+// Inputs: none 
+// Outputs: number of blocks ready for writing without an erase 
+uint16_t OS_FS_PoolDepth(void){
+	uint32_t per_block = Block_Sectors;
+	uint32_t first, i;
+	uint16_t depth = 0;
+	
+	settle_erase();
+	for (first = 0; first + per_block <= Meta_First_Sector; first += per_block) {
+		for (i = 0; i < per_block; ++i) {
+			if (!Bit_Test(Free_Bitmap, first + i) || !Bit_Test(Erased_Bitmap, first + i)) {
+				break;
+			}
+		}
+		if (i == per_block) {
+			++depth;
+		}
+	}
+	return depth;
+}
+
+// Helper function program_entries writes the first 'count' entries of
+// a table as entry words into its freshly erased sectors, a burst at a
+// time; entries of FS_NULL stay erased
+static uint8_t program_entries(const sector_t *table, uint32_t first_sector, uint32_t count){
+	uint32_t address = Sector_Address(first_sector);
+	uint32_t words[Burst_Words];
+	uint8_t retVal = 0;
+	uint32_t i, j, size;
+	
+	for (i = 0; i < count; i += size) {
+		size = (count - i < Burst_Words) ? count - i : Burst_Words;
+		for (j = 0; j < size; ++j) {
+			words[j] = (table[i + j] == FS_NULL) ? Erased_Word : Entry(table[i + j]);
+		}
+		retVal |= program_range(address + 4 * i, (uint8_t *)words, 4 * size);
+	}
+	return retVal;
+}
+
+// Helper function slot_erase_next finds the first block of a slot that
+// is not erased yet; returns its first sector, or FS_NULL if the whole
+// slot is erased
+static sector_t slot_erase_next(uint8_t slot){
+	uint32_t first;
+	const uint32_t *word;
+	int i;
+	
+	for (first = Slot_Sector(slot); first < Slot_Sector(slot) + Slot_Sectors;
+	     first += Block_Sectors) {
+		word = (const uint32_t *)sector_pointer(first);
+		for (i = 0; i < Block_Size / 4; ++i) {
+			if (word[i] != Erased_Word) {
+				return first;
+			}
+		}
+	}
+	return FS_NULL;
+}
+
+// Helper function write_checkpoint writes the whole directory and FAT
+// as entry words into the standby slot under a new generation, with the
+// erase counts and an empty journal after the superblock, then makes it the active slot;
+// the old slot is erased later by OS_FS_Idle
+// Returns 0 if success, 255 on disk write failure
+static uint8_t write_checkpoint(void){
+	FS_INSTRUMENT_START(entry);
+	FS_TRACE_START(FS_OP_CHECKPOINT, 255, 0);
+	sector_t first;
+	Meta_Header header;
+	uint8_t retVal = 0;
+	
+	// the standby slot is normally erased in the background already
+	Meta_Slot = 1 - Meta_Slot;
+	Journal_Next = 0;
+	while ((first = slot_erase_next(Meta_Slot)) != FS_NULL) {
+		if (erase_block(first) != NOERROR) {
+			Meta_Slot = 1 - Meta_Slot;
+			FS_TRACE_END(FS_OP_CHECKPOINT, 255, 255, FS_NULL, 0);
+			FS_INSTRUMENT_STOP(FS_OP_CHECKPOINT, entry);
+			return 255;
+		}
+		count_erase(first);
+		++OS_FS_Stats.erase_stalls;
+	}
+	
+	retVal |= program_entries(RAM_Directory, Directory_Sector, 256);
+	retVal |= program_entries(RAM_FAT, FAT_Sector, Disk_Sectors);
+	retVal |= program_range(Sector_Address(Journal_Sector) + 4 * Header_Words,
+	                        (uint8_t *)Block_Erases, 4 * Erase_Blocks);
+	
+	// writing the superblock last commits the new slot
+	header.magic = Meta_Magic;
+	header.version = Meta_Layout;
+	header.generation = ++Meta_Generation;
+	header.crc = meta_crc(&header);
+	retVal |= program_range(Sector_Address(Journal_Sector),
+	                        (uint8_t *)&header, sizeof(header));
+	
+	if (retVal != 0) {
+		// the old slot is still valid and newer than anything here
+		Meta_Slot = 1 - Meta_Slot;
+		--Meta_Generation;
+		FS_TRACE_END(FS_OP_CHECKPOINT, 255, 255, FS_NULL, 0);
+		FS_INSTRUMENT_STOP(FS_OP_CHECKPOINT, entry);
+		return 255;
+	}
+	Standby_Erased = 0;
+	Journal_Next = Journal_First;
+	memset(Erase_Pending, 0, sizeof(Erase_Pending));
+	memset(Dir_Journaled, 0, sizeof(Dir_Journaled));
+	memset(FAT_Journaled, 0, sizeof(FAT_Journaled));
+	clear_dirty();
+	++OS_FS_Stats.checkpoints;
+	FS_TRACE_END(FS_OP_CHECKPOINT, 255, 0, FS_NULL, 0);
+	FS_INSTRUMENT_STOP(FS_OP_CHECKPOINT, entry);
+	return 0;
+}
+
+// Helper function journal_changes appends a record for every dirty
+// entry and every block erased since the last flush, and a commit
+// record, programming them a burst at a time
+static uint8_t journal_changes(void){
+	uint32_t journal = Sector_Address(Journal_Sector);
+	record_t records[Burst_Words];
+	uint8_t retVal = 0;
+	uint32_t table, n, count = 0;
+	
+	for (table = 0; table < 2; ++table) {
+		uint32_t *dirty = (table == 0) ? Dir_Dirty : FAT_Dirty;
+		for (n = 0; n < ((table == 0) ? 256 : Disk_Sectors); ++n) {
+			if (!Bit_Test(dirty, n)) {
+				continue;
+			}
+			records[count++] = (table == 0) ? Record(Record_Directory, n, RAM_Directory[n])
+			                                : Record(Record_FAT, n, RAM_FAT[n]);
+			Bit_Set((table == 0) ? Dir_Journaled : FAT_Journaled, n);
+			if (count == Burst_Words) {
+				retVal |= program_range(journal + sizeof(record_t) * Journal_Next, (uint8_t *)records, sizeof(record_t) * count);
+				Journal_Next += count;
+				OS_FS_Stats.journal_records += count;
+				count = 0;
+			}
+		}
+	}
+	for (n = 0; n < Erase_Blocks; ++n) {
+		if (Erase_Pending[n] == 0) {
+			continue;
+		}
+		records[count++] = Record(Record_Erase, n, Erase_Pending[n]);
+		if (count == Burst_Words) {
+			retVal |= program_range(journal + sizeof(record_t) * Journal_Next, (uint8_t *)records, sizeof(record_t) * count);
+			Journal_Next += count;
+			OS_FS_Stats.journal_records += count;
+			count = 0;
+		}
+	}
+	records[count++] = Record(Record_Commit, Meta_Generation & 0xFF, 0);
+	retVal |= program_range(journal + sizeof(record_t) * Journal_Next, (uint8_t *)records, sizeof(record_t) * count);
+	Journal_Next += count;
+	OS_FS_Stats.journal_records += count;
+	
+	if (retVal != 0) {
+		// the tail of the journal cannot be trusted any more
+		Journal_Next = 0;
+		return 255;
+	}
+	clear_dirty();
+	memset(Erase_Pending, 0, sizeof(Erase_Pending));
+	return 0;
+}
+
+//******** OS_File_Flush************* 
+// Update working buffers onto the disk 
+// Power can be removed after calling flush 
+// Most appends are already on flash (see append_fat); only entries 
+// that changed in other ways are written, as journal records, and 
+// when the journal is full the tables are written out whole as a 
+// new checkpoint 
+// Inputs: none 
+// Outputs: 0 if success 
+// Errors: 255 on disk write failure 
+uint8_t OS_File_Flush(void){
+	FS_INSTRUMENT_START(entry);
+	FS_TRACE_START(FS_OP_FLUSH, 255, 0);
+	uint32_t changed = count_dirty() + count_wear();
+	uint8_t retVal = 0;
+	
+	if (changed != 0) {
+		LED_Red();
+		FlashAsync_Wait();
+		if (Journal_Next == 0 || Journal_Next + changed + 1 > Journal_Records) {
+			retVal = write_checkpoint();
+		} else {
+			retVal = journal_changes();
+		}
+		LED_Green();
+		++OS_FS_Stats.commits;
+	} else {
+		clear_dirty();
+	}
+	FS_TRACE_END(FS_OP_FLUSH, 255, retVal, FS_NULL, 0);
+	FS_INSTRUMENT_STOP(FS_OP_FLUSH, entry);
+	return retVal;
+}
+
+// Helper function count_dirty returns the number of directory and FAT
+// entries changed since the last flush
+static uint32_t count_dirty(void){
+	uint32_t changed = 0;
+	uint32_t i;
+	
+	for (i = 0; i < 256; ++i) {
+		if (Bit_Test(Dir_Dirty, i)) ++changed;
+	}
+	for (i = 0; i < Disk_Sectors; ++i) {
+		if (Bit_Test(FAT_Dirty, i)) ++changed;
+	}
+	return changed;
+}
+
+// Helper function count_wear returns the number of blocks erased since
+// the last flush
+static uint32_t count_wear(void){
+	uint32_t changed = 0;
+	uint32_t i;
+	
+	for (i = 0; i < Erase_Blocks; ++i) {
+		if (Erase_Pending[i] != 0) ++changed;
+	}
+	return changed;
+}
+
+// Helper function release_chain frees every sector of the chain that
+// starts at sector n, clearing their FAT entries on the way; the
+// sectors are reusable once the change is flushed
+static void release_chain(sector_t n){
+	sector_t next;
+	
+	while (n != FS_NULL) {
+		next = RAM_FAT[n];
+		RAM_FAT[n] = FS_NULL;
+		if (next != FS_NULL) {
+			Bit_Set(FAT_Dirty, n);
+		}
+		RAM_Skip[n] = FS_NULL;
+		Bit_Set(Release_Bitmap, n);
+		n = next;
+	}
+}
+
+//******** OS_File_Truncate************* 
+// Keep only the first sectors of a file 
+// The rest of the chain is returned to the free pool in one pass; 
+// its sectors are reused after the next OS_File_Flush 
+// Inputs: num, 8-bit file number, 0 to 254 
+//         sectors, number of sectors to keep 
+// Outputs: 0 if successful, including when the file is not longer 
+// Errors: 255 if num is not a file number 
+uint8_t OS_File_Truncate(uint8_t num, sector_t sectors){
+	FS_INSTRUMENT_START(entry);
+	FS_TRACE_START(FS_OP_TRUNCATE, num, sectors);
+	File_Descriptor *file = &RAM_Descriptor[num];
+	sector_t first, last;
+	int i;
+	
+	if (num == 255) {
+		FS_TRACE_END(FS_OP_TRUNCATE, num, 255, FS_NULL, 0);
+		FS_INSTRUMENT_STOP(FS_OP_TRUNCATE, entry);
+		return 255;
+	}
+	if (sectors >= file->sectors) {
+		FS_TRACE_END(FS_OP_TRUNCATE, num, 0, FS_NULL, 0);
+		FS_INSTRUMENT_STOP(FS_OP_TRUNCATE, entry);
+		return 0;
+	}
+	
+	// cut the chain after the last sector kept
+	if (sectors == 0) {
+		first = RAM_Directory[num];
+		RAM_Directory[num] = FS_NULL;
+		Bit_Set(Dir_Dirty, num);
+	} else {
+		last = seek_sector(num, sectors - 1);
+		first = RAM_FAT[last];
+		RAM_FAT[last] = FS_NULL;
+		Bit_Set(FAT_Dirty, last);
+	}
+	release_chain(first);
+	index_file(num);
+	
+	for (i = 0; i < Max_Handles; ++i) {
+		if (RAM_Handle[i].file == num && RAM_Handle[i].offset > sectors) {
+			RAM_Handle[i].offset = sectors;
+			RAM_Handle[i].sector = file->tail;
+		}
+	}
+	FS_TRACE_END(FS_OP_TRUNCATE, num, 0, FS_NULL, 0);
+	FS_INSTRUMENT_STOP(FS_OP_TRUNCATE, entry);
+	return 0;
+}
+
+//******** OS_File_Delete************* 
+// Remove a file and return its sectors to the free pool 
+// The file number is free for OS_File_New again; open handles on it 
+// read as an empty file 
+// Inputs: num, 8-bit file number, 0 to 254 
+// Outputs: 0 if successful 
+// Errors: 255 if num is not a file number 
+uint8_t OS_File_Delete(uint8_t num){
+	FS_INSTRUMENT_START(entry);
+	FS_TRACE_START(FS_OP_DELETE, num, 0);
+	if (OS_File_Truncate(num, 0) != 0) {
+		FS_TRACE_END(FS_OP_DELETE, num, 255, FS_NULL, 0);
+		FS_INSTRUMENT_STOP(FS_OP_DELETE, entry);
+		return 255;
+	}
+	RAM_Limit[num] = 0;
+	FS_TRACE_END(FS_OP_DELETE, num, 0, FS_NULL, 0);
+	FS_INSTRUMENT_STOP(FS_OP_DELETE, entry);
+	return 0;
+}
+
+//******** OS_FS_Log_Mode************* 
+// Switch log-structured allocation on or off 
+// In log mode sectors are written in circular order and a cleaner 
+// keeps Log_Reserve erased segments ahead of the head, doing at most 
+// Clean_Budget segments of work per append, each the copies of its 
+// live sectors or, once they are committed, the start of one 
+// background erase 
+// Inputs: on, 1 for log mode, 0 for least-worn allocation 
+// Outputs: none 
+void OS_FS_Log_Mode(uint8_t on){
+	Log_Mode = on;
+}
+
+//******** OS_File_Limit************* 
+// Keep only the newest sectors of a file 
+// Once the file holds more than 'sectors' sectors, each append drops 
+// the oldest one, which the cleaner or the erase pool reclaims after 
+// the next flush 
+// Inputs: num, 8-bit file number, 0 to 254 
+//         sectors, most sectors kept, 0 for no limit 
+// Outputs: 0 if successful 
+// Errors: 255 if num is not a file number 
+uint8_t OS_File_Limit(uint8_t num, sector_t sectors){
+	FS_INSTRUMENT_START(entry);
+	if (num == 255) {
+		FS_INSTRUMENT_STOP(FS_OP_LIMIT, entry);
+		return 255;
+	}
+	RAM_Limit[num] = sectors;
+	FS_INSTRUMENT_STOP(FS_OP_LIMIT, entry);
+	return 0;
+}
+
+//******** OS_FS_Commit_Policy************* 
+// Choose when metadata changed by appends is committed to flash 
+// A commit happens after 'appends' appends or once the oldest 
+// uncommitted append is 'ms' milliseconds old, whichever comes first; 
+// OS_File_Flush is the explicit barrier 
+// The time limit needs OS_FS_Tick called every millisecond, and the 
+// commit itself runs in the next OS_File_Append or OS_FS_Idle 
+// Inputs: appends, 1 to commit every append, 0 for no limit 
+//         ms, time limit in milliseconds, 0 for no limit 
+// Outputs: none 
+void OS_FS_Commit_Policy(uint16_t appends, uint16_t ms){
+	Commit_Appends = appends;
+	Commit_Ms = ms;
+	Commit_Due = 0;
+	Commit_Age = 0;
+}
+
+//******** OS_FS_Tick************* 
+// Advance the commit timer by one millisecond 
+// Call from a 1 ms periodic interrupt such as SysTick_Handler; no 
+// flash is touched here 
+// Inputs: none 
+// Outputs: none 
+void OS_FS_Tick(void){
+	if (Durable_Sequence == Append_Sequence || Commit_Ms == 0) {
+		return;
+	}
+	if (++Commit_Age >= Commit_Ms) {
+		Commit_Due = 1;
+	}
+}
+
+//******** OS_FS_Sequence************* 
+// Sequence number of the latest append, to pass to OS_FS_Wait 
+// Inputs: none 
+// Outputs: counts appends since reset, wrapping at 2^32 
+uint32_t OS_FS_Sequence(void){
+	return Append_Sequence;
+}
+
+//******** OS_FS_Durable************* 
+// Sequence number of the latest append that survives a power loss 
+// Inputs: none 
+// Outputs: every append up to this number is on flash 
+uint32_t OS_FS_Durable(void){
+	return Durable_Sequence;
+}
+
+//******** OS_FS_Wait************* 
+// Wait until the append with the given sequence number is durable 
+// With a time limit set the caller sleeps until the commit falls due, 
+// otherwise the commit is done right away 
+// Inputs: sequence, from OS_FS_Sequence after the append 
+// Outputs: 0 if success 
+// Errors: 255 on disk write failure 
+uint8_t OS_FS_Wait(uint32_t sequence){
+	while ((int32_t)(sequence - Durable_Sequence) > 0) {
+		if (Commit_Ms == 0 || Commit_Due) {
+			return OS_File_Flush();
+		}
+		WaitForInterrupt();
+	}
+	return 0;
+}
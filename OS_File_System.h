@@ -1,15 +1,116 @@
+#ifndef OS_FILE_SYSTEM_H
+#define OS_FILE_SYSTEM_H
+
+#include "FlashAsync.h"
+
+// Bytes per sector, chosen at compile time: a power of two from 128
+// (one FWBn burst) to 2048 (two erase blocks)
+#ifndef FS_SECTOR_SIZE
+#define FS_SECTOR_SIZE 512
+#endif
+#if FS_SECTOR_SIZE != 128 && FS_SECTOR_SIZE != 256 && FS_SECTOR_SIZE != 512 && \
+    FS_SECTOR_SIZE != 1024 && FS_SECTOR_SIZE != 2048
+#error "FS_SECTOR_SIZE must be 128, 256, 512, 1024 or 2048"
+#endif
+
+// Width of a sector number, chosen at compile time: 8 bits address up
+// to 255 data sectors with one-byte tables, 16 bits up to 65535; small
+// sectors need 16 bits to cover the default disk
+#ifndef FS_SECTOR_BITS
+#if FS_SECTOR_SIZE < 512
+#define FS_SECTOR_BITS 16
+#else
+#define FS_SECTOR_BITS 8
+#endif
+#endif
+#if FS_SECTOR_BITS == 8
+typedef uint8_t sector_t;
+#elif FS_SECTOR_BITS == 16
+typedef uint16_t sector_t;
+#else
+#error "FS_SECTOR_BITS must be 8 or 16"
+#endif
+#define FS_NULL ((sector_t)~0)          // end of chain, empty file, no sector
+
+// Most sectors a disk may have, metadata included; sets the size of
+// the tables indexed by sector
+#ifndef FS_MAX_SECTORS
+#if FS_SECTOR_BITS == 8
+#define FS_MAX_SECTORS 256
+#else
+#define FS_MAX_SECTORS 1024
+#endif
+#endif
+
+// Disk used by OS_FS_Init: the upper 128 KB of the TM4C123 flash
+#ifndef FS_DISK_START
+#define FS_DISK_START 0x20000
+#endif
+#ifndef FS_DISK_SIZE
+#define FS_DISK_SIZE 0x20000
+#endif
+
+// Counters kept by eDisk_WriteSector
+typedef struct {
+	uint32_t program_ops;     // Flash_FastWrite/Flash_Write calls issued
+	uint32_t ops_saved;       // calls elided because their words were erased
+	uint32_t words_skipped;   // erased words never sent to the flash
+} eDisk_Counters;
+
+extern eDisk_Counters eDisk_Stats;
+
+// Counters kept by the file system
+typedef struct {
+	uint32_t erases;          // blocks erased
+	uint32_t erase_stalls;    // erases done while an allocation waited
+	uint32_t erase_waits;     // sector writes that waited for a background erase
+	uint32_t mount_cycles;    // CPU cycles spent in the last OS_FS_Mount
+	uint32_t journal_records; // metadata journal words written, commits included
+	uint32_t checkpoints;     // full directory/FAT rewrites
+	uint32_t inplace_writes;  // entries programmed in place without an erase
+	uint32_t commits;         // flushes that wrote metadata
+	uint32_t relocations;     // sectors moved by wear leveling or the log cleaner
+	uint32_t segments_cleaned; // log segments erased by the cleaner
+} OS_FS_Counters;
+
+extern OS_FS_Counters OS_FS_Stats;
+
 void LED_Init(void);
 void LED_Red(void);
 void LED_Green(void);
 void OS_FS_Init(void);
+uint8_t OS_FS_Geometry(uint32_t, uint32_t);
 uint8_t OS_File_New( void);
-uint8_t OS_File_Size(uint8_t);
-uint8_t find_free_sector(void);
-uint8_t last_sector(uint8_t);
-void append_fat(uint8_t, uint8_t);
-uint8_t OS_File_Read( uint8_t, uint8_t, uint8_t*);
-uint8_t eDisk_WriteSector(uint8_t*, uint8_t);
+sector_t OS_File_Size(uint8_t);
+sector_t find_free_sector(void);
+sector_t last_sector(uint8_t);
+sector_t seek_sector(uint8_t, sector_t);
+void append_fat(uint8_t, sector_t);
+uint8_t OS_File_Read( uint8_t, sector_t, uint8_t[FS_SECTOR_SIZE]);
+uint8_t eDisk_WriteSector(uint8_t[FS_SECTOR_SIZE], sector_t);
+uint8_t eDisk_WriteSectorAsync(uint8_t[FS_SECTOR_SIZE], sector_t, FlashAsync_Callback, void*);
+void eDisk_ReadSector(uint8_t[FS_SECTOR_SIZE], sector_t);
+const uint8_t *OS_File_ReadPtr(uint8_t, sector_t);
+const uint8_t *OS_File_Map(uint8_t, sector_t, sector_t, uint32_t*);
+uint8_t OS_File_Open(uint8_t);
+uint8_t OS_File_ReadNext(uint8_t, uint8_t[FS_SECTOR_SIZE]);
+uint8_t OS_File_Seek(uint8_t, sector_t);
+uint8_t OS_File_Close(uint8_t);
 uint8_t OS_File_Flush( void);
 int Flash_Erase(uint32_t);
 uint8_t OS_File_Format( void);
-uint8_t OS_File_Append(uint8_t num, uint8_t buf[512]);
+uint8_t OS_FS_Idle(void);
+uint16_t OS_FS_PoolDepth(void);
+uint8_t OS_FS_Mount(void);
+void OS_FS_Commit_Policy(uint16_t, uint16_t);
+void OS_FS_Tick(void);
+uint32_t OS_FS_Sequence(void);
+uint32_t OS_FS_Durable(void);
+uint8_t OS_FS_Wait(uint32_t);
+void OS_FS_Log_Mode(uint8_t);
+uint8_t OS_File_Limit(uint8_t, sector_t);
+uint8_t OS_File_Truncate(uint8_t, sector_t);
+uint8_t OS_File_Delete(uint8_t);
+uint8_t OS_File_Append(uint8_t num, uint8_t buf[FS_SECTOR_SIZE]);
+
+#endif
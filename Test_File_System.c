@@ -2,19 +2,734 @@
 // John Tadrous
 // August 9, 2020
 
+#ifdef FLASH_EMULATED
+#include <stdio.h>
+#include <string.h>
+#else
 #include "tm4c123gh6pm.h"
+#endif
 #include "tm4c123gh6pm_def.h"
 #include "OS_File_System.h"
+#include "FlashProgram.h"
+#include "FS_Trace.h"
+#if defined(FS_BENCHMARK) && !defined(FLASH_EMULATED)
+#include "FS_Benchmark.h"
+#endif
 
 uint8_t File0, File1, File_Size;
-uint8_t Data[512];
+uint8_t Data[FS_SECTOR_SIZE < 256 ? 256 : FS_SECTOR_SIZE]; // one sector, and room for the 200-byte patterns
 uint8_t Process_FB;
 
+// SysTick every 1 ms at the 16 MHz default bus clock drives the
+// group-commit timer
+void SysTick_Init(void){
+#ifndef FLASH_EMULATED
+  NVIC_ST_CTRL_R = 0;                   // disable SysTick during setup
+  NVIC_ST_RELOAD_R = 16000 - 1;         // 1 ms period
+  NVIC_ST_CURRENT_R = 0;                // any write to current clears it
+  NVIC_ST_CTRL_R = NVIC_ST_CTRL_ENABLE|NVIC_ST_CTRL_CLK_SRC|NVIC_ST_CTRL_INTEN;
+#endif
+}
+
+void SysTick_Handler(void){
+  OS_FS_Tick();
+}
+
+#ifdef FLASH_EMULATED
+// host build: checks that need the flash emulator, each run on a
+// freshly formatted disk; OS_FS_Mount stands in for a power cycle
+int Failures;                           // checks that did not hold
+
+void Check(int ok, const char *what){
+  if(!ok){
+    printf("FAIL: %s\n", what);
+    Failures++;
+  }
+}
+
+// fill Data with a pattern that identifies sector 'id' of file num
+void Stamp(uint8_t num, uint32_t id){
+  uint32_t i;
+  for(i=0; i<FS_SECTOR_SIZE; i++){
+    Data[i] = (uint8_t)(id*7 + i*13 + num);
+  }
+}
+
+// 1 if sector 'loc' of file num reads back as Stamp(num, id) wrote it
+int Holds(uint8_t num, sector_t loc, uint32_t id){
+  uint8_t expected[FS_SECTOR_SIZE];
+  Stamp(num, id);
+  memcpy(expected, Data, FS_SECTOR_SIZE);
+  return OS_File_Read(num, loc, Data) == 0 && memcmp(expected, Data, FS_SECTOR_SIZE) == 0;
+}
+
+// 1 if file num holds ids first, first+1, ... in order, at least
+// 'least' and at most 'most' of them
+int Holds_Run(uint8_t num, uint32_t first, sector_t least, sector_t most){
+  sector_t size = OS_File_Size(num), loc;
+  if(size < least || size > most){
+    return 0;
+  }
+  for(loc=0; loc<size; loc++){
+    if(!Holds(num, loc, first + loc)){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// appends linked in place must only be found at mount when every
+// link before them is on flash too: the file is deleted and created
+// again each round, so its first link is journaled, and the few
+// sectors a nearly full disk leaves free are reused with whatever
+// links the rounds before left on flash
+void Test_Remount_Unflushed(void){
+  uint8_t filler, num;
+  uint32_t id, round, count;
+  OS_File_Format();
+  OS_FS_Commit_Policy(0, 0);
+  filler = OS_File_New();
+  for(id=0; ; id++){
+    Stamp(filler, id);
+    if(OS_File_Append(filler, Data) != 0){
+      break;
+    }
+  }
+  OS_File_Truncate(filler, id - 8);
+  OS_File_Flush();
+  for(round=0; round<100; round++){
+    num = OS_File_New();
+    count = 1 + round % 3;
+    for(id=0; id<count; id++){
+      Stamp(num, round*3 + id);
+      OS_File_Append(num, Data);
+    }
+    if(round & 1){
+      OS_File_Flush();
+    }
+    OS_FS_Mount();
+    Check(Holds_Run(num, round*3, (round & 1) ? count : 0, count),
+          "unflushed appends after a power cycle");
+    OS_File_Delete(num);
+    OS_File_Flush();
+  }
+}
+
+// sectors 0 to keep-1 of file num hold ids 0 to keep-1, and the
+// next ones ids first, first+1, ... up to a size of 'size'
+int Holds_After(uint8_t num, sector_t keep, uint32_t first, sector_t size){
+  sector_t loc;
+  if(OS_File_Size(num) != size){
+    return 0;
+  }
+  for(loc=0; loc<size; loc++){
+    if(!Holds(num, loc, loc < keep ? loc : first + loc - keep)){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// truncation and deletion return whole chains, the file number of a
+// deleted file is handed out again, and neither may bring old links
+// back, before or after a power cycle
+void Test_Truncate_Delete(void){
+  uint8_t a, b, c;
+  uint32_t id, full, refill;
+  OS_File_Format();
+  OS_FS_Commit_Policy(0, 0);
+  a = OS_File_New();
+  for(id=0; id<10; id++){
+    Stamp(a, id);
+    OS_File_Append(a, Data);
+  }
+  b = OS_File_New();
+  for(id=0; id<5; id++){
+    Stamp(b, id);
+    OS_File_Append(b, Data);
+  }
+  
+  Check(OS_File_Truncate(a, 4) == 0 && Holds_Run(a, 0, 4, 4), "truncate keeps the first sectors");
+  Check(OS_File_Truncate(a, 9) == 0 && OS_File_Size(a) == 4, "truncate past the end");
+  Check(OS_File_Read(a, 4, Data) != 0, "read past a truncated end");
+  for(id=0; id<3; id++){
+    Stamp(a, 100 + id);
+    OS_File_Append(a, Data);
+  }
+  Check(Holds_After(a, 4, 100, 7), "append after truncate");
+  OS_File_Flush();
+  OS_FS_Mount();
+  Check(Holds_After(a, 4, 100, 7), "truncate then append after a power cycle");
+  
+  // unflushed: the truncate and the appends are lost together, or the
+  // new sectors follow the ones kept
+  OS_File_Truncate(a, 2);
+  OS_File_Flush();
+  for(id=0; id<3; id++){
+    Stamp(a, 200 + id);
+    OS_File_Append(a, Data);
+  }
+  OS_FS_Mount();
+  Check(Holds_After(a, 2, 200, 2) || Holds_After(a, 2, 200, 3) ||
+        Holds_After(a, 2, 200, 4) || Holds_After(a, 2, 200, 5),
+        "unflushed appends after a truncate and a power cycle");
+  
+  Check(OS_File_Delete(b) == 0 && OS_File_Size(b) == 0, "delete empties the file");
+  Check(OS_File_Read(b, 0, Data) != 0, "read a deleted file");
+  c = OS_File_New();
+  Check(c == b, "the number of a deleted file is reused");
+  for(id=0; id<2; id++){
+    Stamp(c, 300 + id);
+    OS_File_Append(c, Data);
+  }
+  Check(Holds_Run(c, 300, 2, 2), "a reused number starts empty");
+  OS_File_Flush();
+  OS_FS_Mount();
+  Check(Holds_Run(c, 300, 2, 2), "a reused number after a power cycle");
+  Check(Holds_After(a, 2, 200, OS_File_Size(a)), "other files after a delete");
+  
+  // the sectors of deleted files hold new data once flushed
+  OS_File_Delete(a);
+  OS_File_Delete(c);
+  OS_File_Flush();
+  a = OS_File_New();
+  for(full=0; ; full++){
+    Stamp(a, full);
+    if(OS_File_Append(a, Data) != 0){
+      break;
+    }
+  }
+  OS_File_Delete(a);
+  OS_File_Flush();
+  a = OS_File_New();
+  for(refill=0; ; refill++){
+    Stamp(a, refill);
+    if(OS_File_Append(a, Data) != 0){
+      break;
+    }
+  }
+  Check(refill == full && Holds_Run(a, 0, full, full), "a deleted file frees all its sectors");
+}
+
+// metadata layout, from OS_File_System.c, for damaging it on purpose
+extern uint32_t Disk_Start_Address, Meta_First_Sector, Slot_Sectors, Journal_Next, Meta_Generation;
+extern uint32_t Block_Erases[];
+extern uint8_t Meta_Slot;
+#define Record_Bytes (FS_SECTOR_BITS == 8 ? 4 : 8)
+#define Record_Erase 0xEB
+#define Record_Commit 0xC0
+
+// tear record 'index' of the active journal the way a power loss
+// during its write would: its type byte never got programmed
+void Tear_Record(uint32_t index){
+  uint32_t addr = Disk_Start_Address + (Meta_First_Sector + Meta_Slot*Slot_Sectors)*FS_SECTOR_SIZE +
+                  index*Record_Bytes;
+  Flash_Write(addr, *(const uint32_t *)FlashEmulator_Pointer(addr) & ~0xFF);
+}
+
+// program a well-formed record at 'index' of the active journal, laid
+// out as Record() in OS_File_System.c
+void Put_Record(uint32_t index, uint8_t type, uint32_t entry, uint32_t value){
+  uint32_t addr = Disk_Start_Address + (Meta_First_Sector + Meta_Slot*Slot_Sectors)*FS_SECTOR_SIZE +
+                  index*Record_Bytes;
+  uint8_t check = (uint8_t)~(type ^ entry ^ (entry >> 8) ^ value ^ (value >> 8));
+  uint64_t record = type | (uint64_t)entry << 8 | (uint64_t)value << (8 + FS_SECTOR_BITS) |
+                    (uint64_t)check << (8 + 2*FS_SECTOR_BITS);
+  Flash_Write(addr, (uint32_t)record);
+  if(Record_Bytes == 8){
+    Flash_Write(addr + 4, (uint32_t)(record >> 32));
+  }
+}
+
+// changes that are not appends reach flash as journal records, which
+// mount replays up to the last intact commit record
+void Test_Journal(void){
+  uint8_t a, b;
+  uint32_t id, checkpoints, erases;
+  OS_File_Format();
+  OS_FS_Commit_Policy(0, 0);
+  a = OS_File_New();
+  for(id=0; id<4; id++){
+    Stamp(a, id);
+    OS_File_Append(a, Data);
+  }
+  b = OS_File_New();
+  for(id=0; id<2; id++){
+    Stamp(b, id);
+    OS_File_Append(b, Data);
+  }
+  OS_File_Truncate(a, 3);
+  OS_File_Flush();
+  OS_FS_Mount();
+  Check(Holds_Run(a, 0, 3, 3) && Holds_Run(b, 0, 2, 2), "journal replayed at mount");
+  
+  OS_File_Truncate(a, 2);
+  OS_File_Flush();
+  OS_File_Truncate(a, 1);
+  OS_File_Flush();
+  OS_File_Delete(b);
+  OS_File_Flush();
+  Tear_Record(Journal_Next - 1);
+  OS_FS_Mount();
+  Check(Holds_Run(a, 0, 1, 1), "commits before a torn commit record are replayed");
+  Check(Holds_Run(b, 0, 2, 2), "records of a torn commit are ignored");
+  
+  // the torn tail cannot take more records, so the next flush writes
+  // a checkpoint
+  checkpoints = OS_FS_Stats.checkpoints;
+  OS_File_Delete(b);
+  OS_File_Flush();
+  Check(OS_FS_Stats.checkpoints == checkpoints + 1, "a torn journal is replaced by a checkpoint");
+  OS_FS_Mount();
+  Check(Holds_Run(a, 0, 1, 1) && OS_File_Size(b) == 0, "changes after a torn journal");
+  
+  // a commit record carries the generation of the slot's checkpoint;
+  // records closed under another generation are not replayed
+  erases = Block_Erases[0];
+  Check(Journal_Next != 0, "the journal takes records again");
+  Put_Record(Journal_Next, Record_Erase, 0, 5);
+  Put_Record(Journal_Next + 1, Record_Commit, Meta_Generation & 0xFF, 0);
+  OS_FS_Mount();
+  Check(Block_Erases[0] == erases + 5, "records committed under the slot's generation");
+  Put_Record(Journal_Next, Record_Erase, 0, 7);
+  Put_Record(Journal_Next + 1, Record_Commit, (Meta_Generation + 1) & 0xFF, 0);
+  OS_FS_Mount();
+  Check(Block_Erases[0] == erases + 5 && Journal_Next == 0 && Holds_Run(a, 0, 1, 1),
+        "records committed under another generation");
+}
+
+// clear a word of the superblock of the active slot: 8 for the
+// generation, 12 for the CRC
+void Damage_Superblock(uint32_t offset){
+  Flash_Write(Disk_Start_Address + (Meta_First_Sector + Meta_Slot*Slot_Sectors)*FS_SECTOR_SIZE + offset, 0);
+}
+
+// a checkpoint goes to the other slot, so when the superblock of the
+// newest one is damaged mount falls back to the one before it
+void Test_Slot_Fallback(void){
+  uint8_t a, b, slot;
+  uint32_t id;
+  OS_File_Format();
+  OS_FS_Commit_Policy(0, 0);
+  a = OS_File_New();
+  for(id=0; id<4; id++){
+    Stamp(a, id);
+    OS_File_Append(a, Data);
+  }
+  b = OS_File_New();
+  for(id=0; id<2; id++){
+    Stamp(b, id);
+    OS_File_Append(b, Data);
+  }
+  OS_File_Truncate(a, 3);
+  OS_File_Flush();
+  // a torn journal makes the next flush write a checkpoint
+  OS_File_Delete(b);
+  OS_File_Flush();
+  Tear_Record(Journal_Next - 1);
+  OS_FS_Mount();
+  slot = Meta_Slot;
+  OS_File_Truncate(a, 2);
+  OS_File_Flush();
+  Check(Meta_Slot != slot, "a checkpoint goes to the other slot");
+  
+  Damage_Superblock(12);
+  Check(OS_FS_Mount() == 0 && Meta_Slot == slot, "mount after a bad CRC");
+  Check(Holds_Run(a, 0, 3, 3) && Holds_Run(b, 0, 2, 2), "files after a bad CRC");
+  
+  OS_File_Truncate(a, 1);
+  OS_File_Flush();
+  Check(Meta_Slot != slot && Holds_Run(a, 0, 1, 1), "a checkpoint over the damaged slot");
+  Damage_Superblock(8);
+  Check(OS_FS_Mount() == 0 && Meta_Slot == slot, "mount after a bad generation");
+  Check(Holds_Run(a, 0, 3, 3) && Holds_Run(b, 0, 2, 2), "files after a bad generation");
+}
+
+void DisableInterrupts(void); // Disable interrupts
+void EnableInterrupts(void);  // Enable interrupts
+
+// completions seen by Completed, in the order the handler ran them
+int Done_Order[FLASH_ASYNC_QUEUE_SIZE + 2];
+int Done_Status[FLASH_ASYNC_QUEUE_SIZE + 2];
+int Done_Count;
+void Completed(void *context, int status){
+  Done_Order[Done_Count] = (int)(intptr_t)context;
+  Done_Status[Done_Count] = status;
+  Done_Count++;
+}
+
+// the flash word 'context' points at, as it was on completion
+uint32_t Done_Word;
+void Completed_Word(void *context, int status){
+  Done_Word = *(const uint32_t *)context;
+  Completed(0, status);
+}
+
+// erase the flash under sector 0 of the disk, which a fresh format
+// leaves free
+void Erase_Sector0(void){
+  uint32_t offset = 0;
+  do{
+    Flash_Erase(Disk_Start_Address + offset);
+    offset += 1024;
+  } while(offset < FS_SECTOR_SIZE);
+}
+
+// the request queue: overflow, completion order, waiting with
+// interrupts masked and the asynchronous sector write
+void Test_Flash_Async(void){
+  static uint32_t words[FLASH_ASYNC_QUEUE_SIZE + 1];
+  const uint32_t *flash;
+  int i, ordered;
+  OS_File_Format();
+  Erase_Sector0();
+  flash = (const uint32_t *)FlashEmulator_Pointer(Disk_Start_Address);
+  
+  // with interrupts off nothing completes, so the queue fills up
+  Done_Count = 0;
+  DisableInterrupts();
+  for(i=0; i<FLASH_ASYNC_QUEUE_SIZE; i++){
+    words[i] = 0x5A000000 + i;
+    Check(FlashAsync_Program(Disk_Start_Address + 4*i, (const uint8_t *)&words[i], 1,
+                             Completed, (void *)(intptr_t)i) == NOERROR, "queue a program");
+  }
+  words[i] = 0x5A000000 + i;
+  Check(FlashAsync_Program(Disk_Start_Address + 4*i, (const uint8_t *)&words[i], 1,
+                           Completed, (void *)(intptr_t)i) == ERROR, "a full queue refuses a request");
+  Check(FlashAsync_Pending() == FLASH_ASYNC_QUEUE_SIZE, "pending requests of a full queue");
+  FlashAsync_Wait();                                 // must poll, not sleep forever
+  Check(FlashAsync_Pending() == 0 && Done_Count == FLASH_ASYNC_QUEUE_SIZE, "wait with interrupts masked");
+  EnableInterrupts();
+  ordered = 1;
+  for(i=0; i<FLASH_ASYNC_QUEUE_SIZE; i++){
+    ordered = ordered && Done_Order[i] == i && Done_Status[i] == NOERROR && flash[i] == words[i];
+  }
+  Check(ordered, "requests complete in order");
+  Check(flash[FLASH_ASYNC_QUEUE_SIZE] == 0xFFFFFFFF, "a refused request is not programmed");
+  Check(Done_Count == FLASH_ASYNC_QUEUE_SIZE, "no completion after interrupts are enabled again");
+  
+  // an erase queued behind a sector write, interrupts enabled
+  Done_Count = 0;
+  Stamp(0, 77);
+  Check(FlashAsync_Erase(Disk_Start_Address, Completed, (void *)1) == NOERROR &&
+        eDisk_WriteSectorAsync(Data, 0, Completed, (void *)2) == 0, "queue an erase and a sector write");
+  FlashAsync_Wait();
+  Check(Done_Count == 2 && Done_Order[0] == 1 && Done_Order[1] == 2 &&
+        Done_Status[0] == NOERROR && Done_Status[1] == NOERROR, "erase and sector write complete in order");
+  Check(memcmp(FlashEmulator_Pointer(Disk_Start_Address), Data, FS_SECTOR_SIZE) == 0,
+        "the sector written asynchronously");
+  
+  // a blocking write with interrupts off leaves its completion
+  // pending; the request queued next must not take it for its own
+  Erase_Sector0();
+  Done_Count = 0;
+  words[0] = 0x5A5A0001;
+  DisableInterrupts();
+  Flash_Write(Disk_Start_Address, 0x12345678);
+  Check(FlashAsync_Program(Disk_Start_Address + 4, (const uint8_t *)&words[0], 1, Completed_Word,
+                           (void *)&flash[1]) == NOERROR, "queue a program behind a blocking write");
+  EnableInterrupts();
+  FlashAsync_Wait();
+  Check(Done_Count == 1 && Done_Status[0] == NOERROR && Done_Word == words[0] && flash[0] == 0x12345678,
+        "a stale completion does not end the next request");
+  OS_File_Format();
+}
+
+#define Max_Handles 8                   // from OS_File_System.c
+
+// 1 if the next sector read through 'handle' is Stamp(num, id)
+int Reads_Next(uint8_t handle, uint8_t num, uint32_t id){
+  uint8_t expected[FS_SECTOR_SIZE];
+  Stamp(num, id);
+  memcpy(expected, Data, FS_SECTOR_SIZE);
+  return OS_File_ReadNext(handle, Data) == 0 && memcmp(expected, Data, FS_SECTOR_SIZE) == 0;
+}
+
+// handles run out, follow their file when it is truncated, when
+// OS_File_Limit drops its oldest sector and when the log cleaner
+// moves the sector they stopped on
+void Test_Handles(void){
+  uint8_t a, hot, h[Max_Handles], i;
+  uint32_t id, moved;
+  int ok;
+  OS_File_Format();
+  OS_FS_Commit_Policy(0, 0);
+  a = OS_File_New();
+  for(id=0; id<10; id++){
+    Stamp(a, id);
+    OS_File_Append(a, Data);
+  }
+  
+  ok = 1;
+  for(i=0; i<Max_Handles; i++){
+    h[i] = OS_File_Open(a);
+    ok = ok && h[i] != 255;
+  }
+  Check(ok, "open every handle");
+  Check(OS_File_Open(a) == 255, "open with no handle left");
+  Check(OS_File_Close(h[0]) == 0 && OS_File_Open(a) == h[0], "a closed handle is reused");
+  Check(OS_File_Close(h[1]) == 0 && OS_File_Close(h[1]) == 255 && OS_File_ReadNext(h[1], Data) == 255 &&
+        OS_File_Seek(h[1], 0) == 255, "a closed handle");
+  for(i=2; i<Max_Handles; i++){
+    OS_File_Close(h[i]);
+  }
+  
+  // truncated below the handle: end of file, then the new sectors
+  ok = 1;
+  for(id=0; id<8; id++){
+    ok = ok && Reads_Next(h[0], a, id);
+  }
+  Check(ok, "read through a handle");
+  OS_File_Truncate(a, 4);
+  Check(OS_File_ReadNext(h[0], Data) == 255, "a handle past a truncated end");
+  Stamp(a, 100);
+  OS_File_Append(a, Data);
+  Check(Reads_Next(h[0], a, 100), "a handle past a truncated end reads the next append");
+  Check(OS_File_Seek(h[0], 5) == 0 && OS_File_ReadNext(h[0], Data) == 255, "seek to the end");
+  Check(OS_File_Seek(h[0], 6) == 255, "seek past the end");
+  Check(OS_File_Seek(h[0], 2) == 0 && Reads_Next(h[0], a, 2) && Reads_Next(h[0], a, 3) &&
+        Reads_Next(h[0], a, 100), "seek back");
+  
+  // the sector a handle stopped on is dropped by OS_File_Limit
+  OS_File_Truncate(a, 0);
+  OS_File_Limit(a, 4);
+  for(id=0; id<4; id++){
+    Stamp(a, id);
+    OS_File_Append(a, Data);
+  }
+  h[1] = OS_File_Open(a);
+  Check(OS_File_Seek(h[0], 0) == 0 && Reads_Next(h[0], a, 0) &&
+        Reads_Next(h[1], a, 0) && Reads_Next(h[1], a, 1), "read before the limit drops sectors");
+  Stamp(a, 4);
+  OS_File_Append(a, Data);
+  Check(Reads_Next(h[0], a, 1) && Reads_Next(h[0], a, 2), "a handle on a dropped sector");
+  Check(Reads_Next(h[1], a, 2), "a handle behind a dropped sector");
+  OS_File_Close(h[0]);
+  OS_File_Close(h[1]);
+  
+  // log mode: each sector of a shares its segment with one of hot,
+  // which dies, so the cleaner moves a's sectors under the handle
+  OS_File_Format();
+  OS_FS_Log_Mode(1);
+  a = OS_File_New();
+  for(id=0; id<8; id++){
+    Stamp(a, id);
+    OS_File_Append(a, Data);
+    if(id == 0){
+      hot = OS_File_New();             // a number is handed out until it is written
+      OS_File_Limit(hot, 2);
+    }
+    Stamp(hot, id);
+    OS_File_Append(hot, Data);
+  }
+  h[0] = OS_File_Open(a);
+  Check(Reads_Next(h[0], a, 0) && Reads_Next(h[0], a, 1), "read before the cleaner runs");
+  moved = OS_FS_Stats.relocations;
+  for(id=8; id<3*Meta_First_Sector; id++){
+    Stamp(hot, id);
+    OS_File_Append(hot, Data);
+    OS_FS_Idle();
+  }
+  // a segment is one sector once sectors reach the 1 KB erase block
+  Check(FS_SECTOR_SIZE >= 1024 || OS_FS_Stats.relocations >= moved + 8, "the cleaner moves every sector of a");
+  ok = 1;
+  for(id=2; id<8; id++){
+    ok = ok && Reads_Next(h[0], a, id);
+  }
+  Check(ok && OS_File_ReadNext(h[0], Data) == 255, "a handle on a moved sector");
+  Check(Holds_Run(a, 0, 8, 8) && Holds_Run(hot, 3*Meta_First_Sector - 2, 2, 2), "files after cleaning");
+  OS_File_Close(h[0]);
+  OS_FS_Log_Mode(0);
+}
+
+// ReadPtr and Map locate sectors in place; Map stops at the end of a
+// run of back-to-back sectors, at 'count' and at the end of the file
+void Test_Map(void){
+  uint8_t a;
+  uint32_t id, length;
+  sector_t run, loc;
+  const uint8_t *first;
+  int ok;
+  OS_File_Format();
+  a = OS_File_New();
+  for(id=0; id<6; id++){
+    Stamp(a, id);
+    OS_File_Append(a, Data);
+  }
+  // the sectors after the third are not reusable before a flush, so
+  // the file continues somewhere else
+  OS_File_Truncate(a, 3);
+  for(id=3; id<6; id++){
+    Stamp(a, id);
+    OS_File_Append(a, Data);
+  }
+  
+  ok = 1;
+  for(loc=0; loc<6; loc+=run){
+    first = OS_File_Map(a, loc, 6, &length);
+    run = length / FS_SECTOR_SIZE;
+    ok = ok && first == OS_File_ReadPtr(a, loc) && run >= 1 && run <= 6 - loc &&
+         length % FS_SECTOR_SIZE == 0;
+    for(id=0; ok && id<run; id++){
+      Stamp(a, loc + id);
+      ok = memcmp(first + id*FS_SECTOR_SIZE, Data, FS_SECTOR_SIZE) == 0 &&
+           OS_File_ReadPtr(a, loc + id) == first + id*FS_SECTOR_SIZE;
+    }
+    // the run ends where the file leaves the next sector on the disk
+    ok = ok && (loc + run == 6 || OS_File_ReadPtr(a, loc + run) != first + run*FS_SECTOR_SIZE);
+    if(!ok){
+      break;
+    }
+  }
+  Check(ok, "map each run of the file");
+  Check(OS_File_Map(a, 0, 6, &length) != 0 && length < 6*FS_SECTOR_SIZE, "map stops at a run boundary");
+  Check(OS_File_Map(a, 0, 1, &length) == OS_File_ReadPtr(a, 0) && length == FS_SECTOR_SIZE, "map one sector");
+  Check(OS_File_Map(a, 5, 4, &length) == OS_File_ReadPtr(a, 5) && length == FS_SECTOR_SIZE,
+        "map stops at the end of the file");
+  Check(OS_File_ReadPtr(a, 6) == 0 && OS_File_ReadPtr(a, FS_NULL) == 0, "read pointer past the end");
+  length = 1;
+  Check(OS_File_Map(a, 6, 1, &length) == 0 && length == 0, "map past the end");
+  length = 1;
+  Check(OS_File_Map(a, 0, 0, &length) == 0 && length == 0, "map no sectors");
+  Check(OS_File_ReadPtr(OS_File_New(), 0) == 0, "read pointer into an empty file");
+}
+
+#define Wear_Threshold 64               // from OS_File_System.c
+#define Block_Bytes (FS_SECTOR_SIZE > 1024 ? FS_SECTOR_SIZE : 1024)
+
+// run OS_FS_Idle until it has nothing left to do, completing the
+// background erases it starts, 'most' steps at most
+void Idle_Steps(int most){
+  while(most-- > 0 && OS_FS_Idle()){
+    while(FlashEmulator_Service()){}
+  }
+}
+
+// consecutive appends to a file land back to back on a blank disk,
+// also when another file was written in between
+void Test_Runs(void){
+  uint8_t a, b;
+  uint32_t id, length, offset;
+  for(offset=0; offset<Meta_First_Sector*FS_SECTOR_SIZE; offset+=1024){
+    Flash_Erase(Disk_Start_Address + offset);
+  }
+  OS_File_Format();
+  a = OS_File_New();
+  for(id=0; id<10; id++){
+    Stamp(a, id);
+    OS_File_Append(a, Data);
+  }
+  b = OS_File_New();
+  for(id=0; id<10; id++){
+    Stamp(b, id);
+    OS_File_Append(b, Data);
+  }
+  for(id=10; id<20; id++){
+    Stamp(a, id);
+    OS_File_Append(a, Data);
+  }
+  Check(OS_File_Map(a, 0, 10, &length) != 0 && length == 10*FS_SECTOR_SIZE, "first appends in one run");
+  Check(OS_File_Map(a, 10, 10, &length) != 0 && length == 10*FS_SECTOR_SIZE, "later appends in one run");
+  Check(OS_File_Map(b, 0, 10, &length) != 0 && length == 10*FS_SECTOR_SIZE, "the other file in one run");
+  Check(Holds_Run(a, 0, 20, 20) && Holds_Run(b, 0, 10, 10), "files written in runs");
+}
+
+// with half the disk cold, rewriting a small file over and over must
+// not wear the free blocks much more than the ones under the cold data
+void Test_Wear_Level(void){
+  uint8_t cold, hot;
+  uint32_t id, round, block, blocks, least, most;
+  int ok = 1;
+  OS_File_Format();
+  OS_FS_Commit_Policy(0, 0);
+  cold = OS_File_New();
+  for(id=0; id<Meta_First_Sector/2; id++){
+    Stamp(cold, id);
+    OS_File_Append(cold, Data);
+  }
+  OS_File_Flush();
+  for(round=0; round<3000 && ok; round++){
+    hot = OS_File_New();
+    for(id=0; id<20 && ok; id++){
+      Stamp(hot, round + id);
+      ok = OS_File_Append(hot, Data) == 0;
+    }
+    OS_File_Flush();
+    OS_File_Delete(hot);
+    OS_File_Flush();
+    Idle_Steps(200);
+  }
+  Check(ok, "rewrites with cold data");
+  blocks = Meta_First_Sector*FS_SECTOR_SIZE/Block_Bytes;
+  least = most = Block_Erases[0];
+  for(block=1; block<blocks; block++){
+    if(Block_Erases[block] < least){
+      least = Block_Erases[block];
+    }
+    if(Block_Erases[block] > most){
+      most = Block_Erases[block];
+    }
+  }
+  Check(least > 0 && most - least <= Wear_Threshold + 16, "erase counts stay within the wear threshold");
+  Check(OS_FS_Stats.relocations > 0 && Holds_Run(cold, 0, Meta_First_Sector/2, Meta_First_Sector/2),
+        "cold data moved and intact");
+}
+
+// log mode with 95% of the disk live: the cleaner keeps up with the
+// appends of a file limited to a few sectors, one idle step each
+void Test_Log_Clean(void){
+  uint8_t cold, hot;
+  uint32_t id, hot_sectors, cold_sectors, cleaned;
+  int ok = 1;
+  OS_File_Format();
+  OS_FS_Commit_Policy(0, 0);
+  OS_FS_Log_Mode(1);
+  hot_sectors = Meta_First_Sector/20;
+  cold_sectors = Meta_First_Sector*95/100 - hot_sectors;
+  cold = OS_File_New();
+  for(id=0; id<cold_sectors && ok; id++){
+    Stamp(cold, id);
+    ok = OS_File_Append(cold, Data) == 0;
+    Idle_Steps(1);
+  }
+  Check(ok, "fill the log to 95%");
+  hot = OS_File_New();
+  OS_File_Limit(hot, hot_sectors);
+  cleaned = OS_FS_Stats.segments_cleaned;
+  for(id=0; id<4*Meta_First_Sector && ok; id++){
+    Stamp(hot, id);
+    ok = OS_File_Append(hot, Data) == 0;
+    Idle_Steps(1);
+  }
+  Check(ok, "no append fails at 95% in log mode");
+  Check(OS_FS_Stats.segments_cleaned > cleaned + Meta_First_Sector*FS_SECTOR_SIZE/Block_Bytes, "the cleaner erases segments");
+  Check(Holds_Run(cold, 0, cold_sectors, cold_sectors) &&
+        Holds_Run(hot, id - hot_sectors, hot_sectors, hot_sectors), "files after cleaning at 95%");
+  OS_FS_Log_Mode(0);
+}
+#endif
+
 int main(void){
   uint8_t i=0;
 	// Initializing the Disk
   OS_FS_Init();
+#if defined(FS_BENCHMARK) && !defined(FLASH_EMULATED)
+  // benchmark build for the board, with FS_BENCHMARK added to the
+  // Define field of the C/C++ options: the suite of FS_Benchmark.c
+  // runs in place of the script below and formats the disk.  The CSV
+  // goes through printf, so it needs fputc retargeted to a UART; or
+  // stop in the loop at the end and read FS_Bench_Results[0] to
+  // FS_Bench_Results[FS_Bench_Count-1] in a Watch window (times in ns).
+  // Process_FB is nonzero if a call failed.  The host runs the same
+  // suite with make bench
+  SysTick_Init();                       // commit timer of the 10 ms policy
+  Process_FB = FS_Benchmark_Run(0) | FS_Benchmark_Run(1);
+  FS_Benchmark_Print();
+  for(;;){}
+#endif
   OS_File_Format();
+  OS_FS_Commit_Policy(16, 100);         // commit every 16 appends or 100 ms
+  SysTick_Init();
   
   // Creating File0
   File0=OS_File_New();    // Create File0
@@ -50,6 +765,36 @@ int main(void){
   Process_FB=OS_File_Read(File1, 0, Data);
   File_Size=OS_File_Size(File0);
   
-  OS_File_Flush();
+  Process_FB=OS_File_Flush();
+  
+#ifdef FLASH_EMULATED
+  // host build: report what the script cost the emulated flash
+  printf("size %u, flush %u\n", (unsigned)File_Size, (unsigned)Process_FB);
+  printf("flash: %lu word programs, %lu buffer programs, %lu erases, %lu violations, %.3f ms busy\n",
+         (unsigned long)FlashEmulator_Stats.word_programs,
+         (unsigned long)FlashEmulator_Stats.buffer_programs,
+         (unsigned long)FlashEmulator_Stats.erases,
+         (unsigned long)FlashEmulator_Stats.violations,
+         FlashEmulator_Time()/1e6);
+  printf("interrupts off: %lu write, %lu fastwrite, %lu erase cycles at most\n",
+         (unsigned long)Flash_MaskedCycles(FLASH_OP_WRITE),
+         (unsigned long)Flash_MaskedCycles(FLASH_OP_FASTWRITE),
+         (unsigned long)Flash_MaskedCycles(FLASH_OP_ERASE));
+#ifdef FS_TRACE
+  FS_Trace_Print();
+#endif
   
+  Test_Remount_Unflushed();
+  Test_Truncate_Delete();
+  Test_Journal();
+  Test_Slot_Fallback();
+  Test_Flash_Async();
+  Test_Handles();
+  Test_Map();
+  Test_Runs();
+  Test_Wear_Level();
+  Test_Log_Clean();
+  printf("%d checks failed\n", Failures);
+  return Process_FB || Failures;
+#endif
 }